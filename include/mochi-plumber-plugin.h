@@ -0,0 +1,68 @@
+/**
+ * @file mochi-plumber-plugin.h
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+#ifndef __MOCHI_PLUMBER_PLUGIN
+#define __MOCHI_PLUMBER_PLUGIN
+
+#include <hwloc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Interface for NIC selection policies loaded at run time.  A plugin is a
+ * shared object that defines a struct mochi_plumber_plugin named
+ * MOCHI_PLUMBER_PLUGIN_SYMBOL; it is used by giving
+ * "plugin:/path/to/plugin.so" (optionally followed by ":<parameters>") as
+ * the NIC policy.  The plugin is loaded and initialized once per policy
+ * handle (see mochi_plumber_policy_create()), so select() is the only call
+ * made per resolution.
+ */
+
+/* bumped whenever the structures below change incompatibly */
+#define MOCHI_PLUMBER_PLUGIN_VERSION 1
+#define MOCHI_PLUMBER_PLUGIN_SYMBOL  "mochi_plumber_plugin"
+
+/* a group of NICs set up by the bucket policy */
+struct mochi_plumber_bucket {
+    int    num_nics;
+    char** nics; /* NIC names (e.g., cxi0) */
+};
+
+/* what a plugin chooses from */
+struct mochi_plumber_plugin_args {
+    hwloc_topology_t                   topology;
+    hwloc_const_cpuset_t               cpuset;  /* the caller's location */
+    hwloc_const_nodeset_t              nodeset; /* ... and its NUMA nodes */
+    int                                nbuckets;
+    const struct mochi_plumber_bucket* buckets;
+    int bucket_idx; /* bucket chosen by the bucket policy */
+};
+
+struct mochi_plumber_plugin {
+    int         version; /* MOCHI_PLUMBER_PLUGIN_VERSION */
+    const char* name;
+    /* Called when a policy handle is created, with the parameters from the
+     * policy string (or NULL).  May be NULL.  Returns 0 on success.
+     */
+    int (*init)(const char* params, void** state);
+    /* Called when the policy handle is freed.  May be NULL. */
+    void (*finalize)(void* state);
+    /* Choose a NIC from args->buckets[args->bucket_idx]; set *nic_idx to
+     * its index there and return 0, or return -1 on error.
+     */
+    int (*select)(void*                                   state,
+                  const struct mochi_plumber_plugin_args* args,
+                  int*                                    nic_idx);
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __MOCHI_PLUMBER_PLUGIN */
@@ -9,24 +9,510 @@
 #ifndef __MOCHI_PLUMBER
 #define __MOCHI_PLUMBER
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Error codes, in addition to -1 for other failures */
+/* every NIC on the node has reached its user limit (see
+ * MOCHI_PLUMBER_MAX_NIC_USERS) */
+#define MOCHI_PLUMBER_ERR_SATURATED     (-2)
+/* unknown bucket policy */
+#define MOCHI_PLUMBER_ERR_BUCKET_POLICY (-3)
+/* unknown NIC policy, or invalid NIC policy parameters */
+#define MOCHI_PLUMBER_ERR_NIC_POLICY    (-4)
+
 /**
  * @brief Resolve the general network address (e.g., cxi://) to a
- * specific network card (e.g., cxi://cxi0).
+ * specific network card (e.g., cxi://cxi0).  Anything after the host part
+ * is kept, so cxi://:5 becomes cxi://cxi0:5; an address that already names
+ * a NIC is returned unchanged.
+ *
+ * Bucket policies: "all", "package", "numa", "auto" (the finest of these
+ * that gives every NUMA node or package with cores the same number of
+ * NICs, ignoring NUMA nodes without cores; see
+ * mochi_plumber_get_last_policy() for which one it chose), or
+ * "passthrough".
+ *
+ * NIC policies: "roundrobin", "random", "bycore", "byset", "byrank" (by
+ * local rank, see mochi_plumber_set_local_rank_fn(), assuming that the
+ * launcher places ranks on buckets in blocks; "byrank:cyclic" assumes
+ * cyclic placement, e.g. Slurm's default), "rendezvous" (all local ranks
+ * agree on a balanced, locality-aware assignment; every local rank must
+ * resolve with it), "leastused" (the NIC with the fewest live leases, the
+ * caller's own included, see mochi_plumber_release_nic()),
+ * "weighted_roundrobin" and "weighted_random" (in proportion to the weights
+ * given as a parameter, e.g. "weighted_random:cxi0=1,cxi1=3", or set in
+ * mochi_plumber_resolve_info or MOCHI_PLUMBER_WEIGHTS),
+ * "plugin:<path>[:<parameters>]" (a site policy loaded from a shared
+ * object, see mochi-plumber-plugin.h), "hash" (consistent hashing of a
+ * stable identity, so that adding or removing a NIC only moves the
+ * processes on it; it trades balance for that stability, e.g. four local
+ * ranks on four NICs may use only two of them, so use "rail" or "byrank"
+ * for an even spread; "hash:service", "hash:rank" or "hash:core" picks the
+ * identity, which otherwise is the service id if there is one, else the
+ * local rank, else the core), "rail" (the same identity picks the same NIC
+ * index, counting in PCI address order, on every node, so that peers talk
+ * over the same rail of a rail-optimized fabric; parameters as for "hash"),
+ * or "passthrough".
+ *
+ * Either policy may also be a chain of fallbacks, e.g. "numa>package>all"
+ * or "byrank>roundrobin": a bucket policy that leaves some bucket without a
+ * NIC gives way to the next one, as does a NIC policy that fails (see
+ * mochi_plumber_get_last_policy()).
+ *
+ * Either policy may be NULL or "default" for the one that the
+ * MOCHI_PLUMBER_CONFIG file gives for this node (see
+ * mochi_plumber_get_node_fingerprint()), or else "auto" and "roundrobin".
+ *
+ * The address may carry overrides for the policies and optional arguments
+ * (see mochi_plumber_resolve_nic_ext()) as "key=value" parameters, e.g.
+ * "cxi://?bucket=numa&nic=bycore"; the keys are "bucket", "nic",
+ * "weights", "class" (service class), "service" (service id) and
+ * "sticky" (1 or 0 to set or clear MOCHI_PLUMBER_STICKY).  They are
+ * stripped from the output address.  Only CXI addresses that don't name a
+ * NIC yet take parameters; any other address is returned unchanged, '?'
+ * and all.
+ *
+ * If MOCHI_PLUMBER_MAX_NIC_USERS limits the processes per NIC (a number,
+ * or "auto" for the endpoint count that libfabric reports), every
+ * resolution takes a lease on its NIC, and a full NIC is passed over for
+ * the closest one with room.
  *
  * @param [in] in_address input address string
  * @param [in] bucket_policy policy for bucket selection
  * @param [in] nic_policy policy for nic selection within bucket
  * @param [out] out_address output address string (to be freed by caller)
+ * @return 0 on success, MOCHI_PLUMBER_ERR_SATURATED if every NIC is full,
+ * MOCHI_PLUMBER_ERR_BUCKET_POLICY or MOCHI_PLUMBER_ERR_NIC_POLICY for an
+ * unknown policy, -1 on other errors
  */
 int mochi_plumber_resolve_nic(const char* in_address,
                               const char* bucket_policy,
                               const char* nic_policy,
                               char**      out_address);
 
+/**
+ * @brief Callback reporting this process's rank among the processes on the
+ * same node, and how many there are (-1 if unknown).  Returns 0 on success.
+ */
+typedef int (*mochi_plumber_local_rank_fn)(int*  local_rank,
+                                           int*  local_size,
+                                           void* arg);
+
+/**
+ * @brief Override how the "byrank" policy finds the local rank.  By default
+ * it is read from MOCHI_PLUMBER_LOCAL_RANK/MOCHI_PLUMBER_LOCAL_SIZE or, if
+ * unset, the variables set by common launchers (SLURM_LOCALID,
+ * PMI_LOCAL_RANK, OMPI_COMM_WORLD_LOCAL_RANK, PALS_LOCAL_RANKID,
+ * MPI_LOCALRANKID).
+ *
+ * @param [in] fn callback, or NULL to restore the default
+ * @param [in] arg argument passed to fn
+ */
+void mochi_plumber_set_local_rank_fn(mochi_plumber_local_rank_fn fn, void* arg);
+
+/* Flags for mochi_plumber_resolve_info.flags */
+/* after resolution, bind the calling thread to the cores local to the
+ * chosen NIC (within its current binding) */
+#define MOCHI_PLUMBER_BIND_THREAD  (1 << 0)
+/* same as MOCHI_PLUMBER_BIND_THREAD, for the whole process */
+#define MOCHI_PLUMBER_BIND_PROCESS (1 << 1)
+/* also bind memory allocations to the chosen NIC's NUMA node(s); applies to
+ * the thread or the process depending on which of the above is set */
+#define MOCHI_PLUMBER_BIND_MEMORY  (1 << 2)
+#define MOCHI_PLUMBER_BIND_MASK \
+    (MOCHI_PLUMBER_BIND_THREAD | MOCHI_PLUMBER_BIND_PROCESS \
+     | MOCHI_PLUMBER_BIND_MEMORY)
+/* Return the NIC that the same service id resolved to last time on this
+ * node (e.g. before a restart), as long as it is still usable (libfabric
+ * still lists it and does not report its link down, and it is neither
+ * excluded nor partitioned away) and in the caller's bucket; otherwise
+ * resolve as usual.  The choice is recorded in the node-local state
+ * directory (see mochi_plumber_release_nic()).  Has no effect without a
+ * service id, or with a NIC policy that agrees on NICs across the node's
+ * processes ("rendezvous"), which every process must take part in.
+ */
+#define MOCHI_PLUMBER_STICKY       (1 << 3)
+
+/**
+ * @brief Optional arguments for mochi_plumber_resolve_nic_ext().  Fields
+ * that are left zeroed fall back to the behavior of
+ * mochi_plumber_resolve_nic().
+ */
+struct mochi_plumber_resolve_info {
+    /* Resolve on behalf of this location rather than wherever the calling
+     * thread is currently running, e.g. to plan placement before a thread
+     * is created and pinned.  Accepts an hwloc bitmap string ("0xffff0000")
+     * or list ("32-47"), optionally prefixed with "cpuset:" or "nodeset:"
+     * to say whether the indices are PUs (default) or NUMA nodes.
+     */
+    const char* location;
+    /* OR'ed MOCHI_PLUMBER_* flags */
+    int flags;
+    /* Relative NIC weights for the weighted_* policies, e.g.
+     * "cxi0=1,cxi1=3" to send three times as many processes to cxi1.  NICs
+     * not listed weigh 1; 0 keeps a NIC out of use; no weight may exceed
+     * 1000000.  Defaults to the MOCHI_PLUMBER_WEIGHTS environment variable.
+     */
+    const char* weights;
+    /* Service class (e.g. "server" or "client") to resolve for.  Only the
+     * NICs that MOCHI_PLUMBER_PARTITIONS reserves for the class (e.g.
+     * "server:cxi0,cxi2;client:cxi1,cxi3") are used, with the bucket
+     * policy applied among them as usual; if it leaves some bucket
+     * without one of them, they are all drawn from as by "all" instead,
+     * and the address is never passed through.  Defaults to the
+     * MOCHI_PLUMBER_SERVICE_CLASS environment variable; without a class,
+     * all NICs are used.
+     */
+    const char* service_class;
+    /* Stable name of the service resolving (e.g. "db-provider-3"), which
+     * the "hash" and "rail" policies and MOCHI_PLUMBER_STICKY key on.
+     * Defaults to the MOCHI_PLUMBER_SERVICE_ID environment variable.
+     */
+    const char* service_id;
+};
+
+/**
+ * @brief Same as mochi_plumber_resolve_nic(), with optional arguments.
+ *
+ * @param [in] in_address input address string
+ * @param [in] bucket_policy policy for bucket selection
+ * @param [in] nic_policy policy for nic selection within bucket
+ * @param [in] info optional arguments (may be NULL)
+ * @param [out] out_address output address string (to be freed by caller)
+ */
+int mochi_plumber_resolve_nic_ext(
+    const char*                              in_address,
+    const char*                              bucket_policy,
+    const char*                              nic_policy,
+    const struct mochi_plumber_resolve_info* info,
+    char**                                   out_address);
+
+/* a bucket and NIC policy pair, parsed and validated once */
+typedef struct mochi_plumber_policy* mochi_plumber_policy_t;
+
+/**
+ * @brief Parse a bucket and NIC policy pair (as taken by
+ * mochi_plumber_resolve_nic()) into a handle, so that they are validated
+ * once rather than at every resolution.  The node's topology and NICs are
+ * discovered once per process, and the handle keeps the buckets that its
+ * bucket policy settles on for each service class (with the NIC
+ * partitions as they were at the first resolution for the class), so
+ * later resolutions with it neither load the topology nor query
+ * libfabric.  A handle may be used by several threads at once.
+ *
+ * @param [in] bucket_policy policy for bucket selection
+ * @param [in] nic_policy policy for nic selection within bucket
+ * @param [out] policy policy handle (to be freed with
+ * mochi_plumber_policy_free())
+ * @return 0 on success, MOCHI_PLUMBER_ERR_BUCKET_POLICY or
+ * MOCHI_PLUMBER_ERR_NIC_POLICY if a policy is invalid, -1 on other errors
+ */
+int mochi_plumber_policy_create(const char*             bucket_policy,
+                                const char*             nic_policy,
+                                mochi_plumber_policy_t* policy);
+
+/**
+ * @brief Free a policy handle.
+ *
+ * @param [in] policy policy handle
+ */
+void mochi_plumber_policy_free(mochi_plumber_policy_t policy);
+
+/**
+ * @brief Same as mochi_plumber_resolve_nic_ext(), with a policy handle.
+ *
+ * @param [in] policy policy handle from mochi_plumber_policy_create()
+ * @param [in] in_address input address string
+ * @param [in] info optional arguments (may be NULL)
+ * @param [out] out_address output address string (to be freed by caller)
+ */
+int mochi_plumber_policy_resolve(
+    mochi_plumber_policy_t                   policy,
+    const char*                              in_address,
+    const struct mochi_plumber_resolve_info* info,
+    char**                                   out_address);
+
+/**
+ * @brief Report which policies of the chains passed to the calling thread's
+ * last resolution were used, e.g. "package" and "roundrobin" for
+ * "numa>package>all" and "byrank>roundrobin", or the bucket policy that
+ * "auto" settled on; both are "passthrough" if the address was passed
+ * through unchanged.
+ *
+ * @param [out] bucket_policy bucket policy used (may be NULL)
+ * @param [out] nic_policy NIC policy used (may be NULL)
+ * @return 0 on success, -1 if this thread has not resolved an address or
+ * its last resolution failed
+ */
+int mochi_plumber_get_last_policy(const char** bucket_policy,
+                                  const char** nic_policy);
+
+/**
+ * @brief Describe the shape of this node, e.g.
+ * "packages=2,numa=8,cores=96,nics=4".
+ *
+ * Rules in the optional file named by MOCHI_PLUMBER_CONFIG can match on
+ * it, to run one binary with policies tuned for each kind of node.  The
+ * file holds "key = value" settings, first for every node, then in rules
+ * headed by space-separated criteria, of which the first that matches this
+ * node applies ('#' starts a comment):
+ *
+ *   weights = cxi0=1,cxi1=1
+ *
+ *   [host=nid00* nics=4]
+ *   bucket_policy = numa
+ *   nic_policy = bycore
+ *
+ *   [fingerprint=packages=2,numa=8,*]
+ *   exclude = cxi3
+ *   partitions = server:cxi0;client:cxi1,cxi2
+ *
+ * Criteria are "host=<pattern>" and "fingerprint=<pattern>" (shell
+ * wildcards) and "nics=<count>".  Settings are the "default" bucket_policy
+ * and nic_policy, NICs to exclude from use, and defaults for
+ * MOCHI_PLUMBER_WEIGHTS and MOCHI_PLUMBER_PARTITIONS.  The file is read
+ * once per process, and not at all if the variable is unset.
+ *
+ * @param [out] fingerprint node fingerprint (to be freed by caller)
+ * @return 0 on success, -1 on failure
+ */
+int mochi_plumber_get_node_fingerprint(char** fingerprint);
+
+/**
+ * @brief Give back the lease that resolving an address took on its NIC.
+ * Resolutions with the "leastused" policy, or with
+ * MOCHI_PLUMBER_MAX_NIC_USERS set, record a lease in a node-local table,
+ * which both balance against (a process holds at most one lease per NIC,
+ * however often it resolves to it); leases held by processes that have
+ * exited are reclaimed automatically.  The table is per user unless
+ * MOCHI_PLUMBER_SHARED_DIR names a directory shared by all users on the
+ * node (e.g. one an administrator created in /dev/shm), in which case
+ * every job's leases count.  Files there must belong to the caller or one
+ * of its groups, so a directory shared between users should be owned by a
+ * group they all belong to, with the set-group-ID bit set.
+ *
+ * @param [in] address resolved address (cxi://cxi0) or NIC name (cxi0)
+ */
+int mochi_plumber_release_nic(const char* address);
+
+/**
+ * @brief Choose which of a server's addresses (one per server NIC) a
+ * client should connect to.  Prefers the server NIC with the same name as
+ * the client's NIC, then the one in the same place among the server's NICs
+ * as the client's NIC is among its own (in PCI address order), so that
+ * traffic stays on one rail; without a local NIC to go by, spreads clients
+ * by hash.
+ *
+ * The server's addresses may name its NICs (e.g. cxi://cxi0:5,
+ * cxi://cxi1:5), in which case they are put in name order (cxi2 before
+ * cxi10), or be the fabric addresses that a CXI server publishes once
+ * listening (e.g. ofi+cxi://0x1a2b0:5, ofi+cxi://0x1a2c0:5), which say
+ * nothing of which NIC is which; those must then be listed in the order
+ * of the server's NICs by PCI address, as the server sees them.  Any
+ * address whose host part does not start with a letter is taken as a
+ * fabric address.
+ *
+ * @param [in] local_address address the client resolved, naming its NIC
+ * (e.g. cxi://cxi1 from mochi_plumber_resolve_nic()), or NULL
+ * @param [in] num_remote number of entries in remote_addresses
+ * @param [in] remote_addresses the server's addresses
+ * @param [out] out_index index into remote_addresses of the chosen one
+ * @return 0 on success, -1 on failure
+ */
+int mochi_plumber_select_remote_address(const char*        local_address,
+                                        int                num_remote,
+                                        const char* const* remote_addresses,
+                                        int*               out_index);
+
+/**
+ * @brief Find the NIC closest to the memory backing a buffer (e.g., the
+ * best NIC to post an RDMA bulk transfer of that buffer on).  If the pages
+ * have not been touched yet, they are assumed to be local to the calling
+ * thread.  Equally close NICs are spread across buffers by address.
+ *
+ * @param [in] addr start of the memory region
+ * @param [in] len length of the memory region
+ * @param [out] out_nic name of the closest NIC, e.g. cxi0 (to be freed by
+ * caller)
+ */
+int mochi_plumber_get_buffer_nic(const void* addr, size_t len, char** out_nic);
+
+/**
+ * @brief Same as mochi_plumber_get_buffer_nic(), but chooses among a list of
+ * NICs that the caller already has open.
+ *
+ * @param [in] addr start of the memory region
+ * @param [in] len length of the memory region
+ * @param [in] num_nics number of entries in nics
+ * @param [in] nics NIC names (cxi0) or resolved addresses (cxi://cxi0)
+ * @param [out] out_index index into nics of the closest NIC
+ */
+int mochi_plumber_get_buffer_nic_index(const void*        addr,
+                                       size_t             len,
+                                       int                num_nics,
+                                       const char* const* nics,
+                                       int*               out_index);
+
+/**
+ * @brief Find the NUMA node that the memory backing a buffer lives on (or,
+ * if the pages have not been touched yet, the one the calling thread is
+ * running on).
+ *
+ * @param [in] addr start of the memory region
+ * @param [in] len length of the memory region
+ * @param [out] numa NUMA node OS index
+ */
+int mochi_plumber_get_buffer_numa(const void* addr, size_t len, int* numa);
+
+/* Flags for mochi_plumber_get_progress_core() */
+/* recommend a single PU rather than a whole physical core */
+#define MOCHI_PLUMBER_PROGRESS_PU      (1 << 0)
+/* reserve the recommendation node-wide so that other processes on the node
+ * are steered elsewhere, until released or until this process exits */
+#define MOCHI_PLUMBER_PROGRESS_RESERVE (1 << 1)
+
+/**
+ * @brief Recommend where to run a dedicated progress thread (e.g. the
+ * Mercury progress execution stream) for a NIC: a physical core local to
+ * the NIC, within this process's binding, that the caller's other bound
+ * threads are not using.  Falls back to an idle PU, then to a shared PU.
+ *
+ * @param [in] nic NIC name (cxi0) or resolved address (cxi://cxi0)
+ * @param [in] exclude additional cpuset (list or 0x form) to avoid, or
+ * NULL
+ * @param [in] flags OR'ed MOCHI_PLUMBER_PROGRESS_* flags
+ * @param [out] out_cpuset recommended cpuset in hwloc list form, e.g. "94-95"
+ * (to be freed by caller)
+ */
+int mochi_plumber_get_progress_core(const char* nic,
+                                    const char* exclude,
+                                    int         flags,
+                                    char**      out_cpuset);
+
+/**
+ * @brief Release a progress core reserved with
+ * MOCHI_PLUMBER_PROGRESS_RESERVE.  Reservations held by processes that have
+ * exited are reclaimed automatically.
+ *
+ * @param [in] cpuset cpuset returned by mochi_plumber_get_progress_core()
+ */
+int mochi_plumber_release_progress_core(const char* cpuset);
+
+/**
+ * @brief Placement of one local rank, as computed by
+ * mochi_plumber_plan_node().
+ */
+struct mochi_plumber_placement {
+    char* cpuset;   /* PUs to bind the rank to, in hwloc list form (0-7) */
+    char* cpu_mask; /* same PUs as a hex mask, e.g. for srun
+                       --cpu-bind=mask_cpu */
+    int   numa;     /* NUMA node to bind the rank's memory to */
+    char* nic;      /* NIC for the rank to use (NULL if none found) */
+};
+
+/**
+ * @brief Plan the placement of every local rank on this node at once:
+ * cores, memory NUMA node and NIC.  Ranks are spread evenly over the node
+ * and matched to NICs as by mochi_plumber_match_ranks(), so the result is
+ * balanced node-wide rather than depending on the order in which ranks
+ * start.
+ *
+ * @param [in] num_ranks number of ranks on the node
+ * @param [in] threads_per_rank number of cores each rank needs
+ * @param [out] placements array of num_ranks placements, indexed by local
+ * rank (to be freed with mochi_plumber_plan_free())
+ * @return 0 on success, -1 on error, including when the node does not have
+ * threads_per_rank cores for every rank
+ */
+int mochi_plumber_plan_node(int                              num_ranks,
+                            int                              threads_per_rank,
+                            struct mochi_plumber_placement** placements);
+
+/**
+ * @brief Release placements returned by mochi_plumber_plan_node().
+ *
+ * @param [in] num_ranks number of placements
+ * @param [in] placements placements to free
+ */
+void mochi_plumber_plan_free(int                             num_ranks,
+                             struct mochi_plumber_placement* placements);
+
+/**
+ * @brief Assign each of a set of local ranks to a NIC, minimizing the total
+ * distance between the ranks' cores and their NICs while putting at most
+ * capacity ranks on any NIC.  Handles ranks with uneven cpusets and buckets
+ * with different NIC counts, where per-process greedy choices would
+ * overload some NICs.
+ *
+ * @param [in] num_ranks number of ranks
+ * @param [in] cpusets cpuset of each rank (list or 0x form)
+ * @param [in] capacity maximum ranks per NIC, or 0 for an even split
+ * @param [out] out_nics caller-provided array of num_ranks entries, each set
+ * to a NIC name (to be freed by caller)
+ */
+int mochi_plumber_match_ranks(int                num_ranks,
+                              const char* const* cpusets,
+                              int                capacity,
+                              char**             out_nics);
+
+typedef struct mochi_plumber_stripe_plan* mochi_plumber_stripe_plan_t;
+
+/**
+ * @brief One piece of a striped transfer.
+ */
+struct mochi_plumber_stripe {
+    int    nic_index; /* index into the NIC list the plan was created with */
+    size_t offset;    /* byte offset into the transfer */
+    size_t length;    /* bytes to move on this NIC */
+};
+
+/**
+ * @brief Create a plan for splitting bulk transfers across several open
+ * NICs.  Each NIC is weighted by its link capacity and its distance from
+ * the buffer; the weights are computed here, once, so that splitting an
+ * individual transfer is cheap.
+ *
+ * @param [in] num_nics number of entries in nics
+ * @param [in] nics NIC names (cxi0) or resolved addresses (cxi://cxi0)
+ * @param [in] granularity stripe lengths are multiples of this (0 for 1)
+ * @param [out] plan resulting plan (to be freed with
+ * mochi_plumber_stripe_plan_free())
+ */
+int mochi_plumber_stripe_plan_create(int                          num_nics,
+                                     const char* const*           nics,
+                                     size_t                       granularity,
+                                     mochi_plumber_stripe_plan_t* plan);
+
+/**
+ * @brief Split a transfer across the NICs of a plan.  Stripes are
+ * contiguous, in NIC order, and NICs that get nothing are left out.  Safe to
+ * call concurrently on the same plan.
+ *
+ * @param [in] plan plan from mochi_plumber_stripe_plan_create()
+ * @param [in] size total transfer size in bytes
+ * @param [in] numa NUMA node the buffer lives on (see
+ * mochi_plumber_get_buffer_numa()), or -1 if unknown
+ * @param [out] stripes caller-provided array with one entry per NIC in the
+ * plan
+ * @param [out] num_stripes number of stripes filled in
+ */
+int mochi_plumber_stripe_plan_compute(mochi_plumber_stripe_plan_t  plan,
+                                      size_t                       size,
+                                      int                          numa,
+                                      struct mochi_plumber_stripe* stripes,
+                                      int*                         num_stripes);
+
+/**
+ * @brief Release a plan created with mochi_plumber_stripe_plan_create().
+ *
+ * @param [in] plan plan to free
+ */
+void mochi_plumber_stripe_plan_free(mochi_plumber_stripe_plan_t plan);
+
 #ifdef __cplusplus
 }
 #endif
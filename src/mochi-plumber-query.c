@@ -11,6 +11,7 @@
 #include <assert.h>
 #include <string.h>
 #include <sched.h>
+#include <getopt.h>
 
 #include <rdma/fabric.h>
 #include <rdma/fi_errno.h>
@@ -21,6 +22,9 @@
 
 struct options {
     char prov_name[256];
+    char location[256];
+    int  plan_ranks;
+    int  plan_threads;
 };
 
 struct nic {
@@ -41,14 +45,36 @@ struct test_combo test_combos[]
        {.bucket_policy = "all", .nic_policy = "random"},
        {.bucket_policy = "all", .nic_policy = "bycore"},
        {.bucket_policy = "all", .nic_policy = "byset"},
+       {.bucket_policy = "all", .nic_policy = "byrank"},
+       {.bucket_policy = "all", .nic_policy = "leastused"},
+       {.bucket_policy = "all", .nic_policy = "weighted_roundrobin"},
+       {.bucket_policy = "all", .nic_policy = "weighted_random"},
+       {.bucket_policy = "all", .nic_policy = "hash"},
+       {.bucket_policy = "all", .nic_policy = "rail"},
        {.bucket_policy = "package", .nic_policy = "roundrobin"},
        {.bucket_policy = "package", .nic_policy = "random"},
        {.bucket_policy = "package", .nic_policy = "bycore"},
        {.bucket_policy = "package", .nic_policy = "byset"},
+       {.bucket_policy = "package", .nic_policy = "byrank"},
+       {.bucket_policy = "package", .nic_policy = "leastused"},
+       {.bucket_policy = "package", .nic_policy = "weighted_roundrobin"},
+       {.bucket_policy = "package", .nic_policy = "weighted_random"},
+       {.bucket_policy = "package", .nic_policy = "hash"},
+       {.bucket_policy = "package", .nic_policy = "rail"},
        {.bucket_policy = "numa", .nic_policy = "roundrobin"},
        {.bucket_policy = "numa", .nic_policy = "random"},
        {.bucket_policy = "numa", .nic_policy = "bycore"},
        {.bucket_policy = "numa", .nic_policy = "byset"},
+       {.bucket_policy = "numa", .nic_policy = "byrank"},
+       {.bucket_policy = "numa", .nic_policy = "leastused"},
+       {.bucket_policy = "numa", .nic_policy = "weighted_roundrobin"},
+       {.bucket_policy = "numa", .nic_policy = "weighted_random"},
+       {.bucket_policy = "numa", .nic_policy = "hash"},
+       {.bucket_policy = "numa", .nic_policy = "rail"},
+       {.bucket_policy = "auto", .nic_policy = "roundrobin"},
+       {.bucket_policy = "numa>package>all",
+        .nic_policy    = "byrank>roundrobin"},
+       {.bucket_policy = "default", .nic_policy = "default"},
        {.bucket_policy = "passthrough", .nic_policy = "passthrough"},
        {0}};
 
@@ -58,6 +84,7 @@ static int print_short_info(struct fi_info* info);
 static int  parse_args(int argc, char** argv, struct options* opts);
 static int  find_nics(struct options* opts, int* num_nics, struct nic** nics);
 static void usage(void);
+static int  print_plan(struct options* opts);
 static int  count_packages(hwloc_topology_t* topology);
 static int  find_cores(struct options* opts,
                        pid_t*          pid,
@@ -77,20 +104,21 @@ static int check_locality(struct options* opts,
 
 int main(int argc, char** argv)
 {
-    struct options opts;
-    struct nic*    nics = NULL;
-    int            num_nics;
-    int            num_cores;
-    int            num_numa;
-    int            num_packages;
-    int            current_core;
-    int            current_numa;
-    int            current_package;
-    pid_t          pid;
-    int            ret;
-    int            i;
-    char           hostname[256] = {0};
-    char*          out_addr      = NULL;
+    struct options                    opts;
+    struct nic*                       nics = NULL;
+    int                               num_nics;
+    int                               num_cores;
+    int                               num_numa;
+    int                               num_packages;
+    int                               current_core;
+    int                               current_numa;
+    int                               current_package;
+    pid_t                             pid;
+    int                               ret;
+    int                               i;
+    char                              hostname[256] = {0};
+    char*                             out_addr      = NULL;
+    struct mochi_plumber_resolve_info info          = {0};
 
     ret = parse_args(argc, argv, &opts);
     if (ret < 0) {
@@ -98,6 +126,8 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
 
+    if (opts.plan_ranks > 0) return (print_plan(&opts));
+
     /* get an array of network interfaces with device ids */
     ret = find_nics(&opts, &num_nics, &nics);
     if (ret < 0) {
@@ -116,6 +146,11 @@ int main(int argc, char** argv)
     gethostname(hostname, 255);
     printf("Host:\n");
     printf("\t%s\n", hostname);
+    if (mochi_plumber_get_node_fingerprint(&out_addr) == 0) {
+        printf("\tfingerprint %s\n", out_addr);
+        free(out_addr);
+        out_addr = NULL;
+    }
 
     printf("\nCPU information:\n");
     printf(
@@ -140,24 +175,43 @@ int main(int argc, char** argv)
         return (-1);
     }
 
+    /* where a dedicated progress thread for each NIC would be placed */
+    printf("\nProgress core recommendations:\n");
+    printf("\t#<name> <cpuset>\n");
+    for (i = 0; i < num_nics; i++) {
+        ret = mochi_plumber_get_progress_core(nics[i].iface_name, NULL, 0,
+                                              &out_addr);
+        if (ret == 0) {
+            printf("\t%s %s\n", nics[i].iface_name, out_addr);
+            free(out_addr);
+            out_addr = NULL;
+        } else
+            printf("\t%s N/A\n", nics[i].iface_name);
+    }
+
     if (nics) free(nics);
 
     /* exercise programmatic fn for resolving addresses to specific NICs */
     printf("\nmochi_plumber_resolve_nic() test cases:\n");
+    if (strlen(opts.location)) {
+        printf("\t(resolved for location %s)\n", opts.location);
+        info.location = opts.location;
+    }
     printf("\t#<bucket policy>\t<NIC policy>\t<in addr>\t<out addr>\n");
 
     i = 0;
     while (test_combos[i].bucket_policy) {
-        ret = mochi_plumber_resolve_nic(opts.prov_name,
-                                        test_combos[i].bucket_policy,
-                                        test_combos[i].nic_policy, &out_addr);
+        ret = mochi_plumber_resolve_nic_ext(
+            opts.prov_name, test_combos[i].bucket_policy,
+            test_combos[i].nic_policy, &info, &out_addr);
         if (ret == 0) {
-            printf("\t%10s\t%12s\t%s\t%s\n", test_combos[i].bucket_policy,
+            printf("\t%10s\t%19s\t%s\t%s\n", test_combos[i].bucket_policy,
                    test_combos[i].nic_policy, opts.prov_name, out_addr);
+            mochi_plumber_release_nic(out_addr);
             if (out_addr) free(out_addr);
             out_addr = NULL;
         } else {
-            printf("\t%10s\t%12s\t%s\tN/A\n", test_combos[i].bucket_policy,
+            printf("\t%10s\t%19s\t%s\tN/A\n", test_combos[i].bucket_policy,
                    test_combos[i].nic_policy, opts.prov_name);
         }
         i++;
@@ -168,29 +222,86 @@ int main(int argc, char** argv)
 
 static void usage(void)
 {
-    fprintf(stderr, "Usage: ofi-dm-query -p <provider_name>\n");
+    fprintf(stderr,
+            "Usage: ofi-dm-query -p <provider_name> [-l <location>]\n");
+    fprintf(stderr, "       ofi-dm-query --plan <ranks> [--threads <n>]\n");
+    fprintf(stderr, "\t-l: resolve for a cpuset or nodeset (e.g. 32-47, "
+                    "nodeset:1) instead of the current core\n");
+    fprintf(stderr, "\t--plan: print a node-wide placement for <ranks> "
+                    "local ranks of <n> threads each\n");
     return;
 }
 
 static int parse_args(int argc, char** argv, struct options* opts)
 {
-    int opt;
-    int ret;
+    int                  opt;
+    int                  ret;
+    static struct option long_opts[]
+        = {{"plan", required_argument, NULL, 'P'},
+           {"threads", required_argument, NULL, 'T'},
+           {0}};
 
     memset(opts, 0, sizeof(*opts));
+    opts->plan_threads = 1;
 
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:l:", long_opts, NULL)) != -1) {
         switch (opt) {
         case 'p':
             ret = sscanf(optarg, "%s", opts->prov_name);
             if (ret != 1) return (-1);
             break;
+        case 'l':
+            ret = sscanf(optarg, "%255s", opts->location);
+            if (ret != 1) return (-1);
+            break;
+        case 'P':
+            ret = sscanf(optarg, "%d", &opts->plan_ranks);
+            if (ret != 1 || opts->plan_ranks < 1) return (-1);
+            break;
+        case 'T':
+            ret = sscanf(optarg, "%d", &opts->plan_threads);
+            if (ret != 1 || opts->plan_threads < 1) return (-1);
+            break;
         default:
             return (-1);
         }
     }
 
-    if (strlen(opts->prov_name) == 0) return (-1);
+    if (strlen(opts->prov_name) == 0 && opts->plan_ranks == 0) return (-1);
+
+    return (0);
+}
+
+static int print_plan(struct options* opts)
+{
+    struct mochi_plumber_placement* placements;
+    int                             ret;
+    int                             i;
+
+    ret = mochi_plumber_plan_node(opts->plan_ranks, opts->plan_threads,
+                                  &placements);
+    if (ret < 0) {
+        fprintf(stderr, "Error: mochi_plumber_plan_node() failure.\n");
+        return (-1);
+    }
+
+    printf("Node plan for %d ranks of %d threads:\n", opts->plan_ranks,
+           opts->plan_threads);
+    printf("\t#<rank> <NIC> <NUMA> <cpuset> <cpu mask>\n");
+    for (i = 0; i < opts->plan_ranks; i++) {
+        printf("\t%d %s %d %s %s\n", i,
+               placements[i].nic ? placements[i].nic : "N/A",
+               placements[i].numa, placements[i].cpuset,
+               placements[i].cpu_mask);
+    }
+
+    printf("\nLauncher CPU binding:\n");
+    printf("\t--cpu-bind=mask_cpu:");
+    for (i = 0; i < opts->plan_ranks; i++)
+        printf("%s%s", i ? "," : "", placements[i].cpu_mask);
+    printf("\n");
+
+    mochi_plumber_plan_free(opts->plan_ranks, placements);
 
     return (0);
 }
@@ -8,512 +8,4461 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <ctype.h>
+#include <fnmatch.h>
 #include <rdma/fabric.h>
 #include <rdma/fi_errno.h>
 #include <hwloc.h>
+#include <hwloc/linux.h>
 
+#include "mochi-plumber.h"
+#include "mochi-plumber-plugin.h"
 #include "mochi-plumber-private.h"
 
+/* same layout as struct mochi_plumber_bucket, so that plugins can be handed
+ * the bucket table as is
+ */
 struct bucket {
     int    num_nics;
     char** nics;
 };
 
-static int select_nic(hwloc_topology_t* topology,
-                      const char*       bucket_policy,
-                      const char*       nic_policy,
-                      int               nbuckets,
-                      struct bucket*    buckets,
-                      const char**      out_nic);
-static int select_nic_roundrobin(int            bucket_idx,
-                                 struct bucket* bucket,
-                                 const char**   out_nic);
-static int
-select_nic_random(int bucket_idx, struct bucket* bucket, const char** out_nic);
-static int  select_nic_bycore(hwloc_topology_t* topology,
-                              int               bucket_idx,
-                              struct bucket*    bucket,
-                              const char**      out_nic);
-static int  select_nic_byset(hwloc_topology_t* topology,
-                             int               bucket_idx,
-                             struct bucket*    bucket,
-                             const char**      out_nic);
+/* an explicit location to resolve on behalf of, in place of wherever the
+ * calling thread happens to be running
+ */
+struct location {
+    hwloc_cpuset_t  cpuset;
+    hwloc_nodeset_t nodeset;
+};
+
+struct nic_entry {
+    char*       name;      /* libfabric domain name (e.g., cxi0) */
+    hwloc_obj_t pci_dev;   /* PCI device in the hwloc topology */
+    hwloc_obj_t locality;  /* first non-I/O ancestor of the PCI device */
+    int         max_eps;   /* endpoints/contexts it supports, 0 if unknown */
+    int         link_down; /* libfabric reported its link down */
+};
+
+/* Process-wide table of NICs and their locality.  Unlike the per-call state
+ * built by mochi_plumber_resolve_nic(), this is discovered once and kept so
+ * that per-operation queries (e.g. buffer locality) stay cheap.
+ */
+struct nic_table {
+    hwloc_topology_t  topology;
+    int               num_nics;
+    struct nic_entry* nics;
+    int               num_numa;
+    int*              numa_cost; /* [num_numa][num_nics], 10 means local */
+};
+
+/* one entry in a node-local reservation file */
+struct reservation {
+    pid_t              pid;
+    unsigned long long start_time; /* to tell a live pid from a reused one */
+    char               name[32];   /* what is reserved (a NIC or PU list) */
+};
+
+/* a NIC and its place in PCI order (see select_nic_rail()) */
+struct rail_nic {
+    const char*        name;
+    unsigned long long pci;
+};
+
+/* a NIC in a list of remote addresses (see
+ * mochi_plumber_select_remote_address())
+ */
+struct remote_nic {
+    const char* name; /* not terminated */
+    size_t      len;
+    int         index; /* in the caller's list */
+};
+
+/* a service's NIC from a previous run (see select_nic_sticky()) */
+struct sticky_entry {
+    char service_id[128];
+    char nic[32];
+};
+
+/* node-local rendezvous table (see select_nic_rendezvous()): a header
+ * followed by one slot per local rank
+ */
+struct rendezvous_header {
+    int num_ranks;
+    int solved;
+    int claimed; /* ranks that have read their NIC */
+};
+
+struct rendezvous_slot {
+    pid_t              pid;
+    unsigned long long start_time;
+    int                registered;
+    int                claimed;
+    char               cpuset[256];
+    char               nic[32];
+};
+
+/* What a NIC policy picks from: the buckets, the one chosen for the caller,
+ * and the caller's location and options.
+ */
+struct selection {
+    const struct nic_level* level; /* the NIC policy in use */
+    hwloc_topology_t*       topology;
+    const struct location*  target;     /* NULL for calling thread */
+    const char*             weights;    /* for weighted_* policies */
+    const char*             service_id; /* NULL if not given */
+    int                     nbuckets;
+    struct bucket*          buckets;
+    int                     bucket_idx;
+};
+
+typedef int (*select_nic_fn)(const struct selection* sel,
+                             const char**            out_nic);
+
+/* NIC policy flags */
+/* picks from every bucket, before one is chosen for the caller */
+#define NIC_POLICY_NODE_WIDE (1 << 0)
+/* records its own lease (see acquire_lease()) */
+#define NIC_POLICY_LEASES    (1 << 1)
+/* takes weights as a parameter ("weighted_random:cxi0=1,cxi1=3") */
+#define NIC_POLICY_WEIGHTS   (1 << 2)
+/* loads a plugin named by its parameter ("plugin:/path/to/plugin.so") */
+#define NIC_POLICY_PLUGIN    (1 << 3)
+/* takes the identity to key on as a parameter ("hash:rank") */
+#define NIC_POLICY_KEY       (1 << 4)
+/* takes how ranks are placed on buckets as a parameter ("byrank:cyclic") */
+#define NIC_POLICY_PLACEMENT (1 << 5)
+
+struct nic_policy {
+    const char*   name;
+    select_nic_fn select;
+    int           flags;
+};
+
+enum bucket_policy { BUCKET_ALL, BUCKET_PACKAGE, BUCKET_NUMA, BUCKET_AUTO };
+
+/* one NIC policy of a chain, with its parameters */
+struct nic_level {
+    const struct nic_policy*           nic;
+    char*                              param; /* NIC policy parameter */
+    void*                              dl;    /* plugin, if any */
+    const struct mochi_plumber_plugin* plugin;
+    void*                              plugin_state;
+};
+
+/* longest fallback chain, e.g. "numa>package>all" */
+#define MAX_POLICY_LEVELS 8
+
+/* largest NIC weight ("weighted_random:cxi0=1,cxi1=3"), so that the sum of
+ * the weights can't overflow
+ */
+#define MAX_NIC_WEIGHT 1000000
+
+/* The buckets that a bucket policy chain settles on for one service class
+ * (see get_buckets()); worked out at the first resolution for the class
+ * and kept, unchanged, until the policy handle is freed.
+ */
+struct bucket_cache {
+    char*                service_class; /* NULL for none */
+    int                  passthrough;   /* no bucket policy fits */
+    enum bucket_policy   bucket_policy; /* the one used, never "auto" */
+    int                  nbuckets;
+    struct bucket*       buckets;
+    struct bucket_cache* next;
+};
+
+/* bucket and NIC policy strings, parsed once; each is a chain of policies
+ * to fall back through in order
+ */
+struct mochi_plumber_policy {
+    char*                bucket_spec; /* as given, for address overrides */
+    char*                nic_spec;
+    int                  passthrough;
+    int                  num_bucket_levels;
+    enum bucket_policy   bucket[MAX_POLICY_LEVELS];
+    int                  num_nic_levels;
+    struct nic_level     nic[MAX_POLICY_LEVELS];
+    struct bucket_cache* cache;
+    pthread_mutex_t      cache_mutex;
+};
+
+/* per-NIC shares of a transfer for each possible buffer location, fixed
+ * when the plan is created
+ */
+struct mochi_plumber_stripe_plan {
+    int     num_nics;
+    int     num_rows;    /* one row per NUMA node, plus one for unknown */
+    size_t  granularity; /* stripe boundaries are multiples of this */
+    double* shares;      /* [num_rows][num_nics], each row sums to 1 */
+    int*    primary;     /* [num_rows] NIC with the largest share */
+};
+
+/* environment variables that launchers use to tell a process its rank among
+ * (and the number of) processes on the same node, in order of preference
+ */
+static const struct {
+    const char* rank;
+    const char* size;
+} g_local_rank_envs[] = {
+    {"MOCHI_PLUMBER_LOCAL_RANK", "MOCHI_PLUMBER_LOCAL_SIZE"},
+    {"SLURM_LOCALID", "SLURM_TASKS_PER_NODE"},
+    {"PMI_LOCAL_RANK", "PMI_LOCAL_SIZE"},
+    {"OMPI_COMM_WORLD_LOCAL_RANK", "OMPI_COMM_WORLD_LOCAL_SIZE"},
+    {"PALS_LOCAL_RANKID", "PALS_LOCAL_SIZE"},
+    {"MPI_LOCALRANKID", "MPI_LOCALNRANKS"},
+    {NULL, NULL}};
+
+static mochi_plumber_local_rank_fn g_local_rank_fn;
+static void*                       g_local_rank_arg;
+
+/* the policies that the calling thread's last resolution ended up using */
+static __thread const char* g_last_bucket_policy;
+static __thread const char* g_last_nic_policy;
+
+/* Settings for this node from the MOCHI_PLUMBER_CONFIG file: those at the
+ * top of the file, overridden by the first rule that matches.  Any of them
+ * may be NULL.
+ */
+struct config {
+    char* bucket_policy;
+    char* nic_policy;
+    char* exclude; /* NICs not to use, e.g. "cxi2,cxi3" */
+    char* weights;
+    char* partitions;
+};
+
+/* what config rules are matched against, looked up when first needed */
+struct node_facts {
+    char hostname[256];
+    char fingerprint[128];
+    int  num_nics; /* -1 until looked up */
+};
+
+static struct config*  g_config;
+static pthread_once_t  g_config_once = PTHREAD_ONCE_INIT;
+
+static struct nic_table* g_nic_table;
+static pthread_mutex_t   g_nic_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the last rendezvous table this process got a NIC from, and the NIC; the
+ * table is removed once every rank has its NIC, so resolving again can't
+ * go back to it
+ */
+static char            g_rendezvous_path[256];
+static char            g_rendezvous_nic[32];
+static pthread_mutex_t g_rendezvous_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int get_buckets(struct mochi_plumber_policy* policy,
+                       struct nic_table*            table,
+                       const char*                  service_class,
+                       const struct bucket_cache**  out_cache);
+static int select_nic(enum bucket_policy bucket_policy,
+                      struct selection*  sel,
+                      const char**       out_nic);
+static int choose_bucket(enum bucket_policy      bucket_policy,
+                         const struct selection* sel);
+static int select_nic_sticky(enum bucket_policy      bucket_policy,
+                             const struct selection* sel,
+                             const char**            out_nic);
+static int record_sticky_nic(const char* service_id, const char* nic);
+static int select_nic_roundrobin(const struct selection* sel,
+                                 const char**            out_nic);
+static int select_nic_random(const struct selection* sel, const char** out_nic);
+static int select_nic_weighted_roundrobin(const struct selection* sel,
+                                          const char**            out_nic);
+static int select_nic_weighted_random(const struct selection* sel,
+                                      const char**            out_nic);
+static int select_nic_weighted(const struct selection* sel,
+                               int                     random,
+                               const char**            out_nic);
+static int parse_weights(const char* weights, struct bucket* bucket, int* w);
+static int next_counter(const char* name, int modulus, int* value);
+static int next_weighted(const char* name,
+                         int         num_nics,
+                         const int*  w,
+                         int         total,
+                         int*        nic_idx);
+static int select_nic_byrank(const struct selection* sel, const char** out_nic);
+static int byrank_position(int local_rank,
+                           int local_size,
+                           int nbuckets,
+                           int cyclic);
+static int get_local_rank(int* local_rank, int* local_size);
+static int slurm_local_size(const char* tasks_per_node);
+static int select_nic_leastused(const struct selection* sel,
+                                const char**            out_nic);
+static int select_nic_plugin(const struct selection* sel, const char** out_nic);
+static int select_nic_hash(const struct selection* sel, const char** out_nic);
+static int select_nic_rail(const struct selection* sel, const char** out_nic);
+static unsigned long long pci_order(hwloc_obj_t pci_dev);
+static int                compare_rails(const void* a, const void* b);
+static int                compare_remotes(const void* a, const void* b);
+static int                selection_identity(const struct selection* sel,
+                                             char*                   key,
+                                             size_t                  len,
+                                             int*                    id);
+static uint64_t           string_hash(const char* a, const char* b);
+static int load_plugin(struct nic_level* level, const char* spec);
+static int  parse_nic_level(const char*       spec,
+                            size_t            len,
+                            struct nic_level* level);
+static void release_nic_level(struct nic_level* level);
+static int  acquire_lease(int                    nbuckets,
+                          struct bucket*         buckets,
+                          struct bucket*         bucket,
+                          const struct location* target,
+                          const char**           out_nic);
+static int  nic_user_cap(struct nic_table* table, int nic_idx);
+static int  spill_nic(struct nic_table*         table,
+                      int                       nbuckets,
+                      struct bucket*            buckets,
+                      const struct location*    target,
+                      const struct reservation* res,
+                      int                       nres,
+                      const char**              out_nic);
+static int  in_buckets(int nbuckets, struct bucket* buckets, const char* nic);
+static int  select_nic_rendezvous(const struct selection* sel,
+                                  const char**            out_nic);
+static int  rendezvous_join(const struct selection* sel,
+                            const char*             path,
+                            int                     local_rank,
+                            int                     local_size,
+                            char*                   nic,
+                            size_t                  nic_len);
+static int  rendezvous_register(int                           fd,
+                                int                           num_ranks,
+                                int                           rank,
+                                const struct rendezvous_slot* slot);
+static int  rendezvous_solve(int                     fd,
+                             int                     num_ranks,
+                             const struct selection* sel);
+static void rendezvous_leave(int         fd,
+                             const char* path,
+                             int         num_ranks,
+                             int         rank);
+static void bucket_nic_table(struct nic_table* table,
+                             int               nbuckets,
+                             struct bucket*    buckets,
+                             struct nic_table* sub);
+static int  select_nic_bycore(const struct selection* sel,
+                              const char**            out_nic);
+static int  select_nic_byset(const struct selection* sel, const char** out_nic);
+static int  bind_to_nic(hwloc_topology_t* topology, const char* nic, int flags);
+static void add_thread_bindings(hwloc_topology_t topology, hwloc_cpuset_t busy);
+static void pick_progress_core(hwloc_topology_t     topology,
+                               hwloc_const_cpuset_t allowed,
+                               hwloc_const_cpuset_t busy,
+                               int                  flags,
+                               hwloc_cpuset_t       chosen);
+static int  get_state_dir(char* path, size_t len);
+static int  open_state_file(const char* name, int flags);
+static int  trusted_state_file(const struct stat* st);
+static int  open_reservations(const char*          name,
+                              struct reservation** res,
+                              int*                 nres);
+static int  close_reservations(int                 fd,
+                               int                 write_back,
+                               struct reservation* res,
+                               int                 nres);
+static int  location_first_index(const struct location* target);
+static int  parse_location(hwloc_topology_t* topology,
+                           const char*       location_string,
+                           struct location*  target);
+static void release_location(struct location* target);
 static int  count_packages(hwloc_topology_t* topology);
-static int  setup_buckets(hwloc_topology_t* topology,
-                          const char*       bucket_policy,
-                          int*              nbuckets,
-                          struct bucket**   buckets);
+static int  discover_nics(hwloc_topology_t*  topology,
+                          int*               num_nics,
+                          struct nic_entry** nics);
+static void release_nics(int num_nics, struct nic_entry* nics);
+static int  get_nic_table(struct nic_table** table);
+static int  numa_nic_cost(hwloc_topology_t          topology,
+                          struct hwloc_distances_s* distances,
+                          int                       numa,
+                          const struct nic_entry*   nic);
+static int  buffer_nodeset(struct nic_table* table,
+                           const void*       addr,
+                           size_t            len,
+                           hwloc_nodeset_t   nodeset);
+static int  nodeset_nic_cost(struct nic_table*     table,
+                             hwloc_const_nodeset_t nodeset,
+                             int                   nic_idx);
+static int  closest_nic(struct nic_table* table,
+                        const void*       addr,
+                        size_t            len,
+                        int               num_candidates,
+                        const int*        candidates,
+                        int*              out_idx);
+static int  find_nic(struct nic_table* table, const char* nic);
+static int  cpuset_nic_cost(struct nic_table*    table,
+                            hwloc_const_cpuset_t cpuset,
+                            int                  nic_idx);
+static int  match_ranks(struct nic_table*     table,
+                        int                   num_ranks,
+                        hwloc_const_cpuset_t* cpusets,
+                        int                   capacity,
+                        int*                  assignment);
+static int  setup_buckets(struct nic_table*   table,
+                          enum bucket_policy* bucket_policy,
+                          const char*         service_class,
+                          int*                nbuckets,
+                          struct bucket**     buckets);
+static int  count_buckets(hwloc_topology_t*  topology,
+                          enum bucket_policy bucket_policy);
+static int  nic_bucket(hwloc_topology_t*       topology,
+                       enum bucket_policy      bucket_policy,
+                       const struct nic_entry* nic);
+static int  buckets_balanced(hwloc_topology_t*  topology,
+                             enum bucket_policy bucket_policy,
+                             int                num_nics,
+                             struct nic_entry*  nics,
+                             const char*        partition);
+static enum bucket_policy auto_bucket_policy(hwloc_topology_t* topology,
+                                             int               num_nics,
+                                             struct nic_entry* nics,
+                                             const char*       partition);
+static void fill_cpuless_buckets(hwloc_topology_t* topology,
+                                 int               nbuckets,
+                                 struct bucket*    buckets);
+static int  find_partition(const char* service_class, char** partition);
+static const struct config* get_config(void);
+static void load_config(void);
+static int  parse_config_line(char*              line,
+                              struct config*     config,
+                              struct node_facts* facts,
+                              int*               state);
+static int  rule_matches(char* criteria, struct node_facts* facts);
+static int  node_fingerprint(char* fingerprint, size_t len, int* num_nics);
+static void drop_excluded_nics(int* num_nics, struct nic_entry* nics);
+static int  in_list(const char* list, const char* name);
 static void release_buckets(int nbuckets, struct bucket* buckets);
 
-static char* canonicalize_addr_string(const char* in_address)
+static unsigned long long proc_start_time(pid_t pid);
+static int                proc_alive(pid_t pid, unsigned long long start_time);
+
+static const char* const g_bucket_policies[]
+    = {[BUCKET_ALL] = "all", [BUCKET_PACKAGE] = "package",
+       [BUCKET_NUMA] = "numa", [BUCKET_AUTO] = "auto"};
+
+static const struct nic_policy g_nic_policies[]
+    = {{"roundrobin", select_nic_roundrobin, 0},
+       {"random", select_nic_random, 0},
+       {"weighted_roundrobin", select_nic_weighted_roundrobin,
+        NIC_POLICY_WEIGHTS},
+       {"weighted_random", select_nic_weighted_random, NIC_POLICY_WEIGHTS},
+       {"bycore", select_nic_bycore, 0},
+       {"byset", select_nic_byset, 0},
+       {"byrank", select_nic_byrank, NIC_POLICY_PLACEMENT},
+       {"leastused", select_nic_leastused, NIC_POLICY_LEASES},
+       {"rendezvous", select_nic_rendezvous, NIC_POLICY_NODE_WIDE},
+       {"hash", select_nic_hash, NIC_POLICY_KEY},
+       {"rail", select_nic_rail, NIC_POLICY_KEY},
+       {"plugin", select_nic_plugin, NIC_POLICY_PLUGIN},
+       {NULL, NULL, 0}};
+
+/* Returns the address without any "?key=value&..." policy parameters,
+ * which are returned separately in *params (NULL if there are none).  If
+ * params is NULL, the address is taken whole.
+ */
+static char* canonicalize_addr_string(const char* in_address, char** params)
 {
-    char* found = NULL;
-    char* canon = NULL;
+    char*  found = NULL;
+    char*  canon = NULL;
+    size_t len;
+
+    if (!params) {
+        len = strlen(in_address);
+    } else {
+        *params = NULL;
+        len     = strcspn(in_address, "?");
+    }
+    if (params && in_address[len]) {
+        *params = strdup(in_address + len + 1);
+        if (!*params) return (NULL);
+    }
 
     found = strstr(in_address, "://");
-    if (found) return (strdup(in_address));
+    if (found && found < in_address + len) {
+        canon = strndup(in_address, len);
+        if (!canon && params) {
+            free(*params);
+            *params = NULL;
+        }
+        return (canon);
+    }
 
     /* assume that if there is no :// present in the address string, then
      * the string must just be an na identifier for Mercury.  Append a "://"
      * to a new string and return it.
      */
-    canon = malloc(strlen(in_address) + 4);
-    if (!canon) return (NULL);
-    sprintf(canon, "%s://", in_address);
+    canon = malloc(len + 4);
+    if (!canon) {
+        if (params) {
+            free(*params);
+            *params = NULL;
+        }
+        return (NULL);
+    }
+    sprintf(canon, "%.*s://", (int)len, in_address);
     return (canon);
 }
 
+/* Find the host (NIC) component of "<provider>://<host>[:<port>][/...]":
+ * its offset and length, which is 0 if the address doesn't name one.
+ */
+static void split_address(const char* address, size_t* host, size_t* len)
+{
+    const char* found;
+
+    found = strstr(address, "://");
+    *host = found ? (size_t)(found - address) + strlen("://") : 0;
+    *len  = strcspn(address + *host, ":/");
+}
+
+/* Split "bucket=numa&nic=bycore&weights=cxi0=1,cxi1=3&class=server" (in
+ * place) into policy overrides; values not given are left alone.
+ */
+static int parse_addr_params(char*                              params,
+                             const char**                       bucket_policy,
+                             const char**                       nic_policy,
+                             struct mochi_plumber_resolve_info* info)
+{
+    char* saveptr = NULL;
+    char* param;
+    char* value;
+
+    for (param = strtok_r(params, "&", &saveptr); param;
+         param = strtok_r(NULL, "&", &saveptr)) {
+        value = strchr(param, '=');
+        if (!value) {
+            fprintf(stderr, "Error: address parameter \"%s\" has no value.\n",
+                    param);
+            return (-1);
+        }
+        *value++ = '\0';
+        if (strcmp(param, "bucket") == 0)
+            *bucket_policy = value;
+        else if (strcmp(param, "nic") == 0)
+            *nic_policy = value;
+        else if (strcmp(param, "weights") == 0)
+            info->weights = value;
+        else if (strcmp(param, "class") == 0)
+            info->service_class = value;
+        else if (strcmp(param, "service") == 0)
+            info->service_id = value;
+        else if (strcmp(param, "sticky") == 0) {
+            if (atoi(value))
+                info->flags |= MOCHI_PLUMBER_STICKY;
+            else
+                info->flags &= ~MOCHI_PLUMBER_STICKY;
+        } else {
+            fprintf(stderr, "Error: unknown address parameter \"%s\".\n",
+                    param);
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
 int mochi_plumber_resolve_nic(const char* in_address,
                               const char* bucket_policy,
                               const char* nic_policy,
                               char**      out_address)
 {
+    return (mochi_plumber_resolve_nic_ext(in_address, bucket_policy,
+                                          nic_policy, NULL, out_address));
+}
 
-    int              nbuckets = 0;
-    hwloc_topology_t topology;
-    struct bucket*   buckets = NULL;
-    int              ret;
-    int              i;
-    const char*      selected_nic;
-    char*            canon_address;
+int mochi_plumber_resolve_nic_ext(
+    const char*                              in_address,
+    const char*                              bucket_policy,
+    const char*                              nic_policy,
+    const struct mochi_plumber_resolve_info* info,
+    char**                                   out_address)
+{
+    mochi_plumber_policy_t policy;
+    int                    ret;
 
-    canon_address = canonicalize_addr_string(in_address);
-    if (!canon_address) return (-1);
+    /* an invalid policy is a failed resolution too */
+    g_last_bucket_policy = NULL;
+    g_last_nic_policy    = NULL;
 
-    /* skip resolution if either policy is set to passthrough */
+    ret = mochi_plumber_policy_create(bucket_policy, nic_policy, &policy);
+    if (ret == MOCHI_PLUMBER_ERR_BUCKET_POLICY)
+        fprintf(stderr,
+                "mochi_plumber_resolve_nic: unknown bucket policy \"%s\"\n",
+                bucket_policy ? bucket_policy : "default");
+    else if (ret == MOCHI_PLUMBER_ERR_NIC_POLICY)
+        fprintf(stderr, "Error: unknown nic_policy \"%s\"\n",
+                nic_policy ? nic_policy : "default");
+    if (ret < 0) return (ret);
+
+    ret = mochi_plumber_policy_resolve(policy, in_address, info, out_address);
+    mochi_plumber_policy_free(policy);
+
+    return (ret);
+}
+
+int mochi_plumber_policy_create(const char*             bucket_policy,
+                                const char*             nic_policy,
+                                mochi_plumber_policy_t* policy)
+{
+    struct mochi_plumber_policy* p;
+    const struct config*         config;
+    const char*                  level;
+    size_t                       len;
+    int                          ret;
+    int                          i;
+
+    /* NULL or "default" takes the policy configured for this node */
+    config = get_config();
+    if (!bucket_policy || strcmp(bucket_policy, "default") == 0)
+        bucket_policy = config && config->bucket_policy
+                          ? config->bucket_policy
+                          : "auto";
+    if (!nic_policy || strcmp(nic_policy, "default") == 0)
+        nic_policy = config && config->nic_policy ? config->nic_policy
+                                                  : "roundrobin";
+
+    *policy = NULL;
+    p       = calloc(1, sizeof(*p));
+    if (!p) return (-1);
+    pthread_mutex_init(&p->cache_mutex, NULL);
+    p->bucket_spec = strdup(bucket_policy);
+    p->nic_spec    = strdup(nic_policy);
+    if (!p->bucket_spec || !p->nic_spec) {
+        ret = -1;
+        goto error;
+    }
+
+    /* either policy being passthrough disables resolution */
     if (strcmp(nic_policy, "passthrough") == 0
         || strcmp(bucket_policy, "passthrough") == 0) {
-        *out_address = canon_address;
+        p->passthrough = 1;
+        *policy        = p;
         return (0);
     }
 
-    /* for now we only manipulate CXI addresses */
-    if (strncmp(canon_address, "cxi", strlen("cxi")) != 0
-        && strncmp(canon_address, "ofi+cxi", strlen("ofi+cxi")) != 0) {
-        /* don't know what this is; just pass it through */
-        *out_address = canon_address;
-        return (0);
+    /* "numa>package>all": try each in turn */
+    for (level = bucket_policy; level; level = strchr(level, '>')) {
+        if (*level == '>') level++;
+        len = strcspn(level, ">");
+        for (i = 0; i < (int)(sizeof(g_bucket_policies) / sizeof(char*));
+             i++) {
+            if (strlen(g_bucket_policies[i]) == len
+                && strncmp(level, g_bucket_policies[i], len) == 0)
+                break;
+        }
+        if (i == sizeof(g_bucket_policies) / sizeof(char*)
+            || p->num_bucket_levels == MAX_POLICY_LEVELS) {
+            ret = MOCHI_PLUMBER_ERR_BUCKET_POLICY;
+            goto error;
+        }
+        p->bucket[p->num_bucket_levels++] = i;
     }
 
-    /* check to make sure the input address is not specific already */
-    if (canon_address[strlen(canon_address) - 1] != '/'
-        || canon_address[strlen(canon_address) - 2] != '/') {
-        /* the address is already resolved to some degree; don't touch it */
-        *out_address = canon_address;
-        return (0);
+    /* likewise "byrank>roundrobin" */
+    for (level = nic_policy; level; level = strchr(level, '>')) {
+        if (*level == '>') level++;
+        len = strcspn(level, ">");
+        if (p->num_nic_levels == MAX_POLICY_LEVELS) {
+            ret = MOCHI_PLUMBER_ERR_NIC_POLICY;
+            goto error;
+        }
+        /* counted even on failure so that the error path releases it */
+        ret = parse_nic_level(level, len, &p->nic[p->num_nic_levels++]);
+        if (ret < 0) goto error;
     }
 
-    /* get topology */
-    hwloc_topology_init(&topology);
-    hwloc_topology_set_io_types_filter(topology,
-                                       HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
-    hwloc_topology_load(topology);
+    *policy = p;
+    return (0);
 
-    /* divide up NICs into buckets that we will later draw from */
-    ret = setup_buckets(&topology, bucket_policy, &nbuckets, &buckets);
-    if (ret < 0) {
-        fprintf(stderr, "Error: setup_buckets() failure.\n");
-        hwloc_topology_destroy(topology);
-        free(canon_address);
-        return (-1);
-    }
+error:
+    mochi_plumber_policy_free(p);
+    return (ret);
+}
 
-    /* sanity check: every bucket must have at least one NIC */
-    for (i = 0; i < nbuckets; i++) {
-        if (buckets[i].num_nics < 1) {
-            // fprintf(stderr, "Error: bucket %d has no NICs\n", i);
-
-            /* If we hit this point, then the node configuration is such
-             * that we shouldn't be attempting to select network cards with
-             * the specified policy (some buckets have no network cards
-             * assigned to them).  Silently pass through input address.
-             *
-             * TODO: should this be a warning?  The "all" bucket policy
-             * would have been fine.  Does matter on any known systems as of
-             * December 2024.
-             */
-            release_buckets(nbuckets, buckets);
-            hwloc_topology_destroy(topology);
-            *out_address = canon_address;
-            return (0);
-        }
+void mochi_plumber_policy_free(mochi_plumber_policy_t policy)
+{
+    struct bucket_cache* cache;
+    int                  i;
+
+    if (!policy) return;
+    while ((cache = policy->cache)) {
+        policy->cache = cache->next;
+        release_buckets(cache->nbuckets, cache->buckets);
+        free(cache->service_class);
+        free(cache);
     }
+    pthread_mutex_destroy(&policy->cache_mutex);
+    for (i = 0; i < policy->num_nic_levels; i++)
+        release_nic_level(&policy->nic[i]);
+    free(policy->bucket_spec);
+    free(policy->nic_spec);
+    free(policy);
+}
+
+/* resolve an address that came with "?..." parameters, which override the
+ * policies and optional arguments given by the caller
+ */
+static int resolve_with_params(mochi_plumber_policy_t                   policy,
+                               const char*                              address,
+                               char*                                    params,
+                               const struct mochi_plumber_resolve_info* info,
+                               char** out_address)
+{
+    struct mochi_plumber_resolve_info override = {0};
+    mochi_plumber_policy_t            override_policy;
+    const char*                       bucket_policy = policy->bucket_spec;
+    const char*                       nic_policy    = policy->nic_spec;
+    int                               ret;
+
+    if (info) override = *info;
+    ret = parse_addr_params(params, &bucket_policy, &nic_policy, &override);
+    if (ret < 0) return (-1);
+
+    /* the caller's handle is reused unless a policy is overridden */
+    if (bucket_policy == policy->bucket_spec
+        && nic_policy == policy->nic_spec)
+        return (mochi_plumber_policy_resolve(policy, address, &override,
+                                             out_address));
 
-    ret = select_nic(&topology, bucket_policy, nic_policy, nbuckets, buckets,
-                     &selected_nic);
+    ret = mochi_plumber_policy_create(bucket_policy, nic_policy,
+                                      &override_policy);
     if (ret < 0) {
-        fprintf(stderr, "Error: failed to select NIC.\n");
-        release_buckets(nbuckets, buckets);
-        hwloc_topology_destroy(topology);
-        free(canon_address);
-        return (-1);
+        fprintf(stderr, "Error: invalid policy \"%s\" / \"%s\" in address.\n",
+                bucket_policy, nic_policy);
+        return (ret);
     }
+    ret = mochi_plumber_policy_resolve(override_policy, address, &override,
+                                       out_address);
+    mochi_plumber_policy_free(override_policy);
 
-    /* generate new address with specific nic */
-    *out_address = malloc(strlen(canon_address) + strlen(selected_nic) + 1);
-    sprintf(*out_address, "%s%s", canon_address, selected_nic);
-
-    release_buckets(nbuckets, buckets);
-    hwloc_topology_destroy(topology);
+    return (ret);
+}
 
-    free(canon_address);
+int mochi_plumber_get_last_policy(const char** bucket_policy,
+                                  const char** nic_policy)
+{
+    if (!g_last_bucket_policy) return (-1);
+    if (bucket_policy) *bucket_policy = g_last_bucket_policy;
+    if (nic_policy) *nic_policy = g_last_nic_policy;
     return (0);
 }
 
-static int select_nic(hwloc_topology_t* topology,
-                      const char*       bucket_policy,
-                      const char*       nic_policy,
-                      int               nbuckets,
-                      struct bucket*    buckets,
-                      const char**      out_nic)
+int mochi_plumber_policy_resolve(
+    mochi_plumber_policy_t                   policy,
+    const char*                              in_address,
+    const struct mochi_plumber_resolve_info* info,
+    char**                                   out_address)
 {
-    int             bucket_idx = 0;
-    int             ret;
-    hwloc_cpuset_t  last_cpu;
-    hwloc_nodeset_t last_numa;
-    hwloc_obj_t     package;
-    hwloc_obj_t     covering;
+    struct nic_table*          table;
+    const struct bucket_cache* cache;
+    int                        nbuckets;
+    struct bucket*             buckets;
+    int                        ret;
+    int                        level;
+    enum bucket_policy         bucket_policy;
+    const char*                selected_nic;
+    const char*                service_class;
+    char*                      canon_address;
+    struct location            target     = {0};
+    struct location*           target_ptr = NULL;
+    struct selection           sel        = {0};
+    char*                      params;
+    size_t                     host;
+    size_t                     host_len;
+    int                        sticky;
+    int                        leased = 0;
+    int                        want_lease;
+    const char*                cap;
+    const char*                used_nic_policy = NULL;
 
-    /* figure out which bucket to draw from */
-    if (nbuckets == 1)
-        bucket_idx = 0;
-    else {
-        if (strcmp(bucket_policy, "numa") == 0) {
-            last_cpu  = hwloc_bitmap_alloc();
-            last_numa = hwloc_bitmap_alloc();
-            assert(last_cpu && last_numa);
+    /* don't report the previous resolution's policies if this one fails;
+     * they are only set again on success
+     */
+    g_last_bucket_policy = NULL;
+    g_last_nic_policy    = NULL;
 
-            /* select a bucket based on the numa domain that this process is
-             * executing in
-             */
-            ret = hwloc_get_last_cpu_location(*topology, last_cpu,
-                                              HWLOC_CPUBIND_THREAD);
-            if (ret < 0) {
-                hwloc_bitmap_free(last_cpu);
-                hwloc_bitmap_free(last_numa);
-                fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
-                return (-1);
-            }
-            hwloc_cpuset_to_nodeset(*topology, last_cpu, last_numa);
-            bucket_idx = hwloc_bitmap_first(last_numa);
-            assert(bucket_idx < nbuckets);
+    canon_address = canonicalize_addr_string(in_address, &params);
+    if (!canon_address) return (-1);
 
-            hwloc_bitmap_free(last_cpu);
-            hwloc_bitmap_free(last_numa);
-        } else if (strcmp(bucket_policy, "package") == 0) {
-            last_cpu = hwloc_bitmap_alloc();
-            assert(last_cpu);
+    /* for now we only manipulate CXI addresses, and only those that don't
+     * name a NIC already; anything after the NIC (e.g. a port) is kept as
+     * is
+     */
+    split_address(canon_address, &host, &host_len);
+    if ((strncmp(canon_address, "cxi", strlen("cxi")) != 0
+         && strncmp(canon_address, "ofi+cxi", strlen("ofi+cxi")) != 0)
+        || host_len > 0) {
+        /* don't know what this is, or it is already resolved to some
+         * degree; pass it through untouched, "?..." and all
+         */
+        if (params) {
+            free(params);
+            free(canon_address);
+            canon_address = canonicalize_addr_string(in_address, NULL);
+            if (!canon_address) return (-1);
+        }
+        g_last_bucket_policy = "passthrough";
+        g_last_nic_policy    = "passthrough";
+        *out_address         = canon_address;
+        return (0);
+    }
 
-            /* select a bucket based on the package that this process is
-             * executing in
-             */
-            ret = hwloc_get_last_cpu_location(*topology, last_cpu,
-                                              HWLOC_CPUBIND_THREAD);
-            if (ret < 0) {
-                hwloc_bitmap_free(last_cpu);
-                fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
-                return (-1);
-            }
-            covering = hwloc_get_obj_covering_cpuset(*topology, last_cpu);
-            package  = hwloc_get_ancestor_obj_by_type(
-                *topology, HWLOC_OBJ_PACKAGE, covering);
+    /* parameters may override the policies, passthrough included */
+    if (params) {
+        ret = resolve_with_params(policy, canon_address, params, info,
+                                  out_address);
+        free(params);
+        free(canon_address);
+        return (ret);
+    }
 
-            bucket_idx = package->os_index;
-            assert(bucket_idx < nbuckets);
+    /* skip resolution if either policy is set to passthrough */
+    if (policy->passthrough) {
+        g_last_bucket_policy = "passthrough";
+        g_last_nic_policy    = "passthrough";
+        *out_address         = canon_address;
+        return (0);
+    }
 
-            hwloc_bitmap_free(last_cpu);
-        } else {
-            fprintf(stderr, "Error: inconsistent bucket policy %s.\n",
-                    bucket_policy);
+    /* the topology and NICs are only discovered once per process */
+    ret = get_nic_table(&table);
+    if (ret != 0) {
+        fprintf(stderr, "Error: failed to discover NICs.\n");
+        free(canon_address);
+        return (-1);
+    }
+
+    /* resolve on behalf of an explicit location if the caller gave one */
+    if (info && info->location) {
+        ret = parse_location(&table->topology, info->location, &target);
+        if (ret < 0) {
+            fprintf(stderr, "Error: invalid location \"%s\".\n",
+                    info->location);
+            free(canon_address);
             return (-1);
         }
+        target_ptr = &target;
     }
 
-    /* select a NIC from within the chosen bucket */
-    if (buckets[bucket_idx].num_nics == 1) {
-        *out_nic = buckets[bucket_idx].nics[0];
-        return (0);
+    /* divide up NICs into buckets that we will later draw from */
+    service_class = info ? info->service_class : NULL;
+    if (!service_class) service_class = getenv("MOCHI_PLUMBER_SERVICE_CLASS");
+    ret = get_buckets(policy, table, service_class, &cache);
+    if (ret < 0) {
+        release_location(target_ptr);
+        free(canon_address);
+        return (-1);
     }
-
-    if (strcmp(nic_policy, "roundrobin") == 0) {
-        ret = select_nic_roundrobin(bucket_idx, &buckets[bucket_idx], out_nic);
-    } else if (strcmp(nic_policy, "random") == 0) {
-        ret = select_nic_random(bucket_idx, &buckets[bucket_idx], out_nic);
-    } else if (strcmp(nic_policy, "bycore") == 0) {
-        ret = select_nic_bycore(topology, bucket_idx, &buckets[bucket_idx],
-                                out_nic);
-    } else if (strcmp(nic_policy, "byset") == 0) {
-        ret = select_nic_byset(topology, bucket_idx, &buckets[bucket_idx],
-                               out_nic);
-    } else {
-        fprintf(stderr, "Error: unknown nic_policy \"%s\"\n", nic_policy);
-        ret = -1;
+    if (cache->passthrough) {
+        /* Silently pass through input address.
+         *
+         * TODO: should this be a warning?  The "all" bucket policy would
+         * have been fine.  Does matter on any known systems as of December
+         * 2024.
+         */
+        release_location(target_ptr);
+        g_last_bucket_policy = "passthrough";
+        g_last_nic_policy    = "passthrough";
+        *out_address         = canon_address;
+        return (0);
     }
+    bucket_policy = cache->bucket_policy;
+    nbuckets      = cache->nbuckets;
+    buckets       = cache->buckets;
 
-    return (ret);
-}
-
-static int select_nic_roundrobin(int            bucket_idx,
-                                 struct bucket* bucket,
-                                 const char**   out_nic)
-{
-    int  ret;
-    char tokenpath[256] = {0};
-    int  fd;
-    int  nic_idx = -1;
+    sel.topology   = &table->topology;
+    sel.target     = target_ptr;
+    sel.nbuckets   = nbuckets;
+    sel.buckets    = buckets;
+    sel.service_id = info ? info->service_id : NULL;
+    if (!sel.service_id) sel.service_id = getenv("MOCHI_PLUMBER_SERVICE_ID");
 
-    snprintf(tokenpath, 256, "/tmp/%s-mochi-plumber", getlogin());
-    ret = mkdir(tokenpath, 0700);
-    if (ret != 0 && errno != EEXIST) {
-        perror("mkdir");
-        fprintf(stderr, "Error: failed to create %s\n", tokenpath);
-        return (-1);
+    /* a service that has been here before goes back to its NIC, unless a
+     * node-wide policy needs every process to take part
+     */
+    ret    = -1;
+    sticky = info && (info->flags & MOCHI_PLUMBER_STICKY) && sel.service_id;
+    for (level = 0; level < policy->num_nic_levels && sticky; level++) {
+        if (policy->nic[level].nic->flags & NIC_POLICY_NODE_WIDE) sticky = 0;
     }
+    if (sticky) ret = select_nic_sticky(bucket_policy, &sel, &selected_nic);
+    if (ret == 0) used_nic_policy = "sticky";
 
-    snprintf(tokenpath, 256, "/tmp/%s-mochi-plumber/%d", getlogin(),
-             bucket_idx);
-    fd = open(tokenpath, O_RDWR | O_CREAT | O_SYNC, 0600);
-    if (fd < 0) {
-        perror("open");
-        fprintf(stderr, "Error: failed to open %s\n", tokenpath);
+    /* likewise try each NIC policy in turn; saturation is final though */
+    for (level = 0; level < policy->num_nic_levels && ret == -1; level++) {
+        sel.level   = &policy->nic[level];
+        sel.weights = NULL;
+        if (sel.level->nic->flags & NIC_POLICY_WEIGHTS)
+            sel.weights = sel.level->param;
+        if (!sel.weights && info) sel.weights = info->weights;
+        if (!sel.weights) sel.weights = getenv("MOCHI_PLUMBER_WEIGHTS");
+        if (!sel.weights && get_config()) sel.weights = get_config()->weights;
+        ret = select_nic(bucket_policy, &sel, &selected_nic);
     }
+    if (ret == 0 && sel.level) used_nic_policy = sel.level->nic->name;
+    if (ret == 0 && sel.level && (sel.level->nic->flags & NIC_POLICY_LEASES))
+        leased = 1;
 
-    /* exlusive lock file */
-    flock(fd, LOCK_EX);
+    /* a sticky NIC is counted like any other by a chain that keeps leases
+     * ("leastused"), so that the next process sees it as used
+     */
+    want_lease = 0;
+    for (level = 0; level < policy->num_nic_levels && !sel.level; level++) {
+        if (policy->nic[level].nic->flags & NIC_POLICY_LEASES) want_lease = 1;
+    }
 
-    /* read most recently used nic index */
-    /* note: if value hasn't been set yet (pread returns 0), nic_idx was
-     * initialized to -1
+    /* if NICs are capped, record that we are using it, moving to another
+     * NIC if it is full ("leastused" has done this already)
      */
-    ret = pread(fd, &nic_idx, sizeof(nic_idx), 0);
-    if (ret < 0) {
-        perror("pread");
-        fprintf(stderr, "Error: failed to read %s\n", tokenpath);
-        flock(fd, LOCK_UN);
-        return (-1);
+    cap = getenv("MOCHI_PLUMBER_MAX_NIC_USERS");
+    if (cap && *cap) want_lease = 1;
+    if (ret == 0 && want_lease && !leased) {
+        ret    = acquire_lease(nbuckets, buckets, NULL, target_ptr,
+                               &selected_nic);
+        leased = ret == 0;
     }
-    /* select next nic */
-    nic_idx = (nic_idx + 1) % (bucket->num_nics);
-    /* write selection back to file */
-    ret = pwrite(fd, &nic_idx, sizeof(nic_idx), 0);
     if (ret < 0) {
-        perror("pwrite");
-        fprintf(stderr, "Error: failed to write %s\n", tokenpath);
-        flock(fd, LOCK_UN);
-        return (-1);
+        if (ret != MOCHI_PLUMBER_ERR_SATURATED) {
+            fprintf(stderr, "Error: failed to select NIC.\n");
+            ret = -1;
+        }
+        release_location(target_ptr);
+        free(canon_address);
+        return (ret);
     }
-    flock(fd, LOCK_UN);
 
-    *out_nic = bucket->nics[nic_idx];
-    return (0);
-}
+    /* optionally pin the caller near the NIC so the decision holds */
+    if (info && (info->flags & MOCHI_PLUMBER_BIND_MASK)) {
+        ret = bind_to_nic(&table->topology, selected_nic, info->flags);
+        if (ret < 0) {
+            fprintf(stderr, "Error: failed to bind to %s.\n", selected_nic);
+            if (leased) mochi_plumber_release_nic(selected_nic);
+            release_location(target_ptr);
+            free(canon_address);
+            return (-1);
+        }
+    }
 
-static int
-select_nic_random(int bucket_idx, struct bucket* bucket, const char** out_nic)
-{
-    int nic_idx = -1;
+    /* remember it for the next run of this service */
+    if (sticky) record_sticky_nic(sel.service_id, selected_nic);
 
-    /* we only need to worry about unique seeding within a single node, so
-     * its sufficient to just use the pid
-     */
-    srand(getpid());
-    nic_idx = rand() % bucket->num_nics;
+    g_last_bucket_policy = g_bucket_policies[bucket_policy];
+    g_last_nic_policy    = used_nic_policy;
 
-    *out_nic = bucket->nics[nic_idx];
+    /* generate new address with specific nic, e.g. cxi://:5 -> cxi://cxi0:5 */
+    *out_address = malloc(strlen(canon_address) + strlen(selected_nic) + 1);
+    sprintf(*out_address, "%.*s%s%s", (int)host, canon_address, selected_nic,
+            canon_address + host);
+
+    release_location(target_ptr);
+
+    free(canon_address);
     return (0);
 }
 
-/* static mapping based on what specific core the process is presently
- * runnign on.
+/* Find (working out and keeping, the first time) the buckets that the
+ * policy's bucket chain settles on for a service class: the first policy
+ * in the chain that gives every bucket a NIC.  If none does, the address is
+ * passed through, unless there is a service class, whose NICs are then all
+ * drawn from as by "all".
  */
-static int select_nic_bycore(hwloc_topology_t* topology,
-                             int               bucket_idx,
-                             struct bucket*    bucket,
-                             const char**      out_nic)
+static int get_buckets(struct mochi_plumber_policy* policy,
+                       struct nic_table*            table,
+                       const char*                  service_class,
+                       const struct bucket_cache**  out_cache)
 {
+    struct bucket_cache* cache;
+    int                  level;
+    int                  ret = 0;
+    int                  i;
+
+    pthread_mutex_lock(&policy->cache_mutex);
+    for (cache = policy->cache; cache; cache = cache->next) {
+        if (!service_class && !cache->service_class) break;
+        if (service_class && cache->service_class
+            && strcmp(cache->service_class, service_class) == 0)
+            break;
+    }
+    if (cache) goto out;
+
+    cache = calloc(1, sizeof(*cache));
+    assert(cache);
+    for (level = 0; level < policy->num_bucket_levels; level++) {
+        /* "auto" is replaced by the policy that it settles on */
+        cache->bucket_policy = policy->bucket[level];
+        ret = setup_buckets(table, &cache->bucket_policy, service_class,
+                            &cache->nbuckets, &cache->buckets);
+        if (ret < 0) {
+            fprintf(stderr, "Error: setup_buckets() failure.\n");
+            goto error;
+        }
+
+        /* sanity check: every bucket must have at least one NIC */
+        for (i = 0; i < cache->nbuckets; i++) {
+            if (cache->buckets[i].num_nics < 1) break;
+        }
+        if (i == cache->nbuckets) break;
+
+        /* If we hit this point, then the node configuration is such that
+         * we shouldn't be attempting to select network cards with this
+         * bucket policy (some buckets have no network cards assigned to
+         * them); fall back to the next one in the chain, if any.
+         */
+        release_buckets(cache->nbuckets, cache->buckets);
+        cache->nbuckets = 0;
+        cache->buckets  = NULL;
+    }
+    if (level == policy->num_bucket_levels && service_class) {
+        /* passing the address through could land on another class's NIC;
+         * draw from all of the class's NICs instead
+         */
+        cache->bucket_policy = BUCKET_ALL;
+        ret = setup_buckets(table, &cache->bucket_policy, service_class,
+                            &cache->nbuckets, &cache->buckets);
+        if (ret == 0 && cache->buckets[0].num_nics < 1) {
+            release_buckets(cache->nbuckets, cache->buckets);
+            cache->buckets = NULL;
+            ret            = -1;
+        }
+        if (ret < 0) {
+            fprintf(stderr, "Error: no NICs for service class \"%s\".\n",
+                    service_class);
+            goto error;
+        }
+    } else if (level == policy->num_bucket_levels)
+        cache->passthrough = 1;
+
+    if (service_class) {
+        cache->service_class = strdup(service_class);
+        assert(cache->service_class);
+    }
+    cache->next   = policy->cache;
+    policy->cache = cache;
+
+out:
+    pthread_mutex_unlock(&policy->cache_mutex);
+    *out_cache = cache;
+    return (0);
+
+error:
+    pthread_mutex_unlock(&policy->cache_mutex);
+    free(cache);
+    return (-1);
+}
+
+int mochi_plumber_release_nic(const char* address)
+{
+    struct reservation* res;
+    size_t              host;
+    size_t              host_len;
+    char                name[32];
+    int                 nres;
+    int                 fd;
+    int                 ret;
+    int                 i;
+
+    /* take the NIC name out of cxi://cxi0[:port] */
+    split_address(address, &host, &host_len);
+    snprintf(name, sizeof(name), "%.*s", (int)host_len, address + host);
+
+    fd = open_reservations("leases", &res, &nres);
+    if (fd < 0) return (-1);
+    /* drop one of our leases on it */
+    for (i = 0; i < nres; i++) {
+        if (res[i].pid == getpid() && strcmp(res[i].name, name) == 0) {
+            res[i] = res[nres - 1];
+            nres--;
+            break;
+        }
+    }
+    /* always write back, which also drops leases of dead processes */
+    ret = close_reservations(fd, 1, res, nres);
+    free(res);
+
+    return (ret);
+}
+
+int mochi_plumber_select_remote_address(const char*        local_address,
+                                        int                num_remote,
+                                        const char* const* remote_addresses,
+                                        int*               out_index)
+{
+    struct nic_table*  table;
+    struct remote_nic* remotes;
+    char               local[32] = "";
+    char               key[300];
+    size_t             host;
+    size_t             len;
+    int                local_idx = -1;
+    int                rail      = 0;
+    int                by_name   = 1;
+    int                i;
+
+    if (num_remote < 1) return (-1);
+
+    if (local_address) {
+        split_address(local_address, &host, &len);
+        snprintf(local, sizeof(local), "%.*s", (int)len, local_address + host);
+    }
+
+    remotes = calloc(num_remote, sizeof(*remotes));
+    if (!remotes) return (-1);
+    for (i = 0; i < num_remote; i++) {
+        split_address(remote_addresses[i], &host, &remotes[i].len);
+        remotes[i].name  = remote_addresses[i] + host;
+        remotes[i].index = i;
+        /* a fabric address (e.g. 0x1a2b) rather than a NIC name */
+        if (!remotes[i].len || !isalpha((unsigned char)remotes[i].name[0]))
+            by_name = 0;
+    }
+
+    /* the same NIC on the other side, e.g. cxi0 to cxi0 */
+    for (i = 0; local[0] && i < num_remote; i++) {
+        if (remotes[i].len == strlen(local)
+            && strncmp(remotes[i].name, local, remotes[i].len) == 0) {
+            *out_index = i;
+            free(remotes);
+            return (0);
+        }
+    }
+
+    /* otherwise the same rail: our NIC's place in PCI order, taken among
+     * the remote NICs in name order (cxi2 before cxi10) or, if they are
+     * fabric addresses, which say nothing of the order, in list order
+     */
+    if (local[0] && get_nic_table(&table) == 0)
+        local_idx = find_nic(table, local);
+    if (local_idx >= 0) {
+        for (i = 0; i < table->num_nics; i++) {
+            if (pci_order(table->nics[i].pci_dev)
+                < pci_order(table->nics[local_idx].pci_dev))
+                rail++;
+        }
+        if (by_name)
+            qsort(remotes, num_remote, sizeof(*remotes), compare_remotes);
+        *out_index = remotes[rail % num_remote].index;
+        free(remotes);
+        return (0);
+    }
+    free(remotes);
+
+    /* no local NIC to go by: spread processes by hashing who we are */
+    gethostname(key, 256);
+    key[255] = '\0';
+    snprintf(key + strlen(key), sizeof(key) - strlen(key), ":%d",
+             (int)getpid());
+    *out_index = string_hash(key, "remote") % num_remote;
+
+    return (0);
+}
+
+/* order remote NICs by name, numerically (cxi2 before cxi10) */
+static int compare_remotes(const void* a, const void* b)
+{
+    const struct remote_nic* x = a;
+    const struct remote_nic* y = b;
+    int                      ret;
+
+    if (x->len != y->len) return (x->len < y->len ? -1 : 1);
+    ret = strncmp(x->name, y->name, x->len);
+    if (ret) return (ret);
+    return (x->index - y->index);
+}
+
+int mochi_plumber_get_buffer_nic(const void* addr, size_t len, char** out_nic)
+{
+    struct nic_table* table;
+    int               nic_idx;
+    int               ret;
+
+    ret = get_nic_table(&table);
+    if (ret != 0) return (-1);
+    if (table->num_nics < 1) {
+        fprintf(stderr, "Error: no NICs found.\n");
+        return (-1);
+    }
+
+    ret = closest_nic(table, addr, len, table->num_nics, NULL, &nic_idx);
+    if (ret < 0) return (-1);
+
+    *out_nic = strdup(table->nics[nic_idx].name);
+    if (!*out_nic) return (-1);
+
+    return (0);
+}
+
+int mochi_plumber_get_buffer_nic_index(const void*        addr,
+                                       size_t             len,
+                                       int                num_nics,
+                                       const char* const* nics,
+                                       int*               out_index)
+{
+    struct nic_table* table;
+    int*              candidates;
+    int               i;
+    int               ret;
+
+    if (num_nics < 1) return (-1);
+
+    ret = get_nic_table(&table);
+    if (ret != 0) return (-1);
+
+    /* translate the caller's NICs into table entries; ones we don't know
+     * about are only picked if none of the others are
+     */
+    candidates = malloc(num_nics * sizeof(*candidates));
+    if (!candidates) return (-1);
+    for (i = 0; i < num_nics; i++) candidates[i] = find_nic(table, nics[i]);
+
+    ret = closest_nic(table, addr, len, num_nics, candidates, out_index);
+    free(candidates);
+
+    return (ret);
+}
+
+int mochi_plumber_get_buffer_numa(const void* addr, size_t len, int* numa)
+{
+    struct nic_table* table;
+    hwloc_nodeset_t   nodeset;
+    int               ret;
+
+    ret = get_nic_table(&table);
+    if (ret != 0) return (-1);
+
+    nodeset = hwloc_bitmap_alloc();
+    assert(nodeset);
+    ret = buffer_nodeset(table, addr, len, nodeset);
+    if (ret == 0) *numa = hwloc_bitmap_first(nodeset);
+    hwloc_bitmap_free(nodeset);
+
+    return (ret);
+}
+
+int mochi_plumber_stripe_plan_create(int                          num_nics,
+                                     const char* const*           nics,
+                                     size_t                       granularity,
+                                     mochi_plumber_stripe_plan_t* plan)
+{
+    struct nic_table*                 table;
+    struct mochi_plumber_stripe_plan* p;
+    int*                              nic_idx;
+    double*                           capacity;
+    double                            known_capacity = 0;
+    int                               num_known      = 0;
+    double                            total;
+    double*                           row;
+    int                               cost;
+    int                               ret;
+    int                               i;
+    int                               j;
+
+    if (num_nics < 1) return (-1);
+
+    ret = get_nic_table(&table);
+    if (ret != 0) return (-1);
+
+    p = calloc(1, sizeof(*p));
+    if (!p) return (-1);
+    p->num_nics    = num_nics;
+    p->num_rows    = table->num_numa + 1;
+    p->granularity = granularity ? granularity : 1;
+    p->shares      = calloc(p->num_rows * num_nics, sizeof(*p->shares));
+    p->primary     = calloc(p->num_rows, sizeof(*p->primary));
+    nic_idx        = calloc(num_nics, sizeof(*nic_idx));
+    capacity       = calloc(num_nics, sizeof(*capacity));
+    assert(p->shares && p->primary && nic_idx && capacity);
+
+    /* link capacity of each NIC, from the PCIe link speed reported by hwloc;
+     * NICs we can't find (or that report no speed) are assumed to be
+     * average
+     */
+    for (i = 0; i < num_nics; i++) {
+        nic_idx[i] = find_nic(table, nics[i]);
+        if (nic_idx[i] >= 0
+            && table->nics[nic_idx[i]].pci_dev->attr->pcidev.linkspeed > 0) {
+            capacity[i]
+                = table->nics[nic_idx[i]].pci_dev->attr->pcidev.linkspeed;
+            known_capacity += capacity[i];
+            num_known++;
+        }
+    }
+    for (i = 0; i < num_nics; i++) {
+        if (capacity[i] == 0)
+            capacity[i] = num_known ? known_capacity / num_known : 1.0;
+    }
+
+    /* weight each NIC by capacity over distance from the buffer; the last
+     * row (buffer location unknown) is weighted by capacity alone
+     */
+    for (i = 0; i < p->num_rows; i++) {
+        row   = &p->shares[i * num_nics];
+        total = 0;
+        for (j = 0; j < num_nics; j++) {
+            cost = 10;
+            if (i < table->num_numa && nic_idx[j] >= 0)
+                cost = table->numa_cost[i * table->num_nics + nic_idx[j]];
+            row[j] = capacity[j] * 10 / cost;
+            total += row[j];
+        }
+        for (j = 0; j < num_nics; j++) {
+            row[j] /= total;
+            if (row[j] > row[p->primary[i]]) p->primary[i] = j;
+        }
+    }
+
+    free(nic_idx);
+    free(capacity);
+
+    *plan = p;
+    return (0);
+}
+
+int mochi_plumber_stripe_plan_compute(mochi_plumber_stripe_plan_t  plan,
+                                      size_t                       size,
+                                      int                          numa,
+                                      struct mochi_plumber_stripe* stripes,
+                                      int*                         num_stripes)
+{
+    const double* row;
+    size_t        assigned = 0;
+    size_t        offset   = 0;
+    size_t        leftover;
+    size_t        tail;
+    int           last;
+    int           r;
+    int           i;
+    int           n = 0;
+
+    /* anything we don't have a row for is treated as unknown */
+    if (numa >= 0 && numa < plan->num_rows - 1)
+        r = numa;
+    else
+        r = plan->num_rows - 1;
+    row = &plan->shares[r * plan->num_nics];
+
+    for (i = 0; i < plan->num_nics; i++) {
+        stripes[i].nic_index = i;
+        stripes[i].length    = (size_t)(size * row[i]);
+        stripes[i].length -= stripes[i].length % plan->granularity;
+        assigned += stripes[i].length;
+    }
+    /* rounding leftovers go to the NIC with the largest share, except for
+     * the sub-granularity tail, which goes to the last stripe so that every
+     * stripe still starts on a granularity boundary
+     */
+    leftover = size - assigned;
+    tail     = leftover % plan->granularity;
+    stripes[plan->primary[r]].length += leftover - tail;
+    last = plan->primary[r];
+    for (i = 0; i < plan->num_nics; i++) {
+        if (stripes[i].length > 0) last = i;
+    }
+    stripes[last].length += tail;
+
+    /* compact out empty stripes and lay the rest out back to back */
+    for (i = 0; i < plan->num_nics; i++) {
+        if (stripes[i].length == 0) continue;
+        stripes[n]        = stripes[i];
+        stripes[n].offset = offset;
+        offset += stripes[n].length;
+        n++;
+    }
+
+    *num_stripes = n;
+    return (0);
+}
+
+void mochi_plumber_stripe_plan_free(mochi_plumber_stripe_plan_t plan)
+{
+    if (!plan) return;
+
+    free(plan->shares);
+    free(plan->primary);
+    free(plan);
+
+    return;
+}
+
+int mochi_plumber_get_progress_core(const char* nic,
+                                    const char* exclude,
+                                    int         flags,
+                                    char**      out_cpuset)
+{
+    struct nic_table*   table;
+    hwloc_cpuset_t      allowed;
+    hwloc_cpuset_t      busy;
+    hwloc_cpuset_t      chosen;
+    hwloc_cpuset_t      reserved;
+    struct reservation* res  = NULL;
+    int                 nres = 0;
+    int                 fd   = -1;
+    int                 nic_idx;
+    int                 ret;
+    int                 i;
+
+    ret = get_nic_table(&table);
+    if (ret != 0) return (-1);
+    nic_idx = find_nic(table, nic);
+    if (nic_idx < 0) {
+        fprintf(stderr, "Error: unknown NIC \"%s\".\n", nic);
+        return (-1);
+    }
+
+    allowed  = hwloc_bitmap_alloc();
+    busy     = hwloc_bitmap_alloc();
+    chosen   = hwloc_bitmap_alloc();
+    reserved = hwloc_bitmap_alloc();
+    assert(allowed && busy && chosen && reserved);
+
+    /* candidates are the NIC's local cores that this process may use, or
+     * any core it may use if there are none
+     */
+    ret = hwloc_get_cpubind(table->topology, allowed, HWLOC_CPUBIND_PROCESS);
+    if (ret < 0)
+        hwloc_bitmap_copy(allowed,
+                          hwloc_topology_get_allowed_cpuset(table->topology));
+    hwloc_bitmap_and(chosen, allowed, table->nics[nic_idx].locality->cpuset);
+    if (!hwloc_bitmap_iszero(chosen)) hwloc_bitmap_copy(allowed, chosen);
+    hwloc_bitmap_zero(chosen);
+
+    /* stay away from what the caller and our other threads are using */
+    if (exclude) {
+        if (strncmp(exclude, "0x", strlen("0x")) == 0)
+            ret = hwloc_bitmap_sscanf(busy, exclude);
+        else
+            ret = hwloc_bitmap_list_sscanf(busy, exclude);
+        if (ret < 0) {
+            fprintf(stderr, "Error: invalid cpuset \"%s\".\n", exclude);
+            goto error;
+        }
+    }
+    add_thread_bindings(table->topology, busy);
+
+    /* ... and from what other processes on the node have reserved (every
+     * PU of it, e.g. both hyperthreads of a whole core)
+     */
+    if (flags & MOCHI_PLUMBER_PROGRESS_RESERVE) {
+        fd = open_reservations("progress", &res, &nres);
+        if (fd < 0) goto error;
+        for (i = 0; i < nres; i++) {
+            if (hwloc_bitmap_list_sscanf(reserved, res[i].name) == 0)
+                hwloc_bitmap_or(busy, busy, reserved);
+        }
+    }
+
+    pick_progress_core(table->topology, allowed, busy, flags, chosen);
+
+    if (fd >= 0) {
+        res = realloc(res, (nres + 1) * sizeof(*res));
+        assert(res);
+        memset(&res[nres], 0, sizeof(*res));
+        res[nres].pid        = getpid();
+        res[nres].start_time = proc_start_time(getpid());
+        hwloc_bitmap_list_snprintf(res[nres].name, sizeof(res[nres].name),
+                                   chosen);
+        ret = close_reservations(fd, 1, res, nres + 1);
+        fd  = -1;
+        if (ret < 0) goto error;
+    }
+
+    ret = hwloc_bitmap_list_asprintf(out_cpuset, chosen);
+    if (ret < 0) goto error;
+
+    free(res);
+    hwloc_bitmap_free(allowed);
+    hwloc_bitmap_free(busy);
+    hwloc_bitmap_free(chosen);
+    hwloc_bitmap_free(reserved);
+    return (0);
+
+error:
+    if (fd >= 0) close_reservations(fd, 0, NULL, 0);
+    free(res);
+    hwloc_bitmap_free(allowed);
+    hwloc_bitmap_free(busy);
+    hwloc_bitmap_free(chosen);
+    hwloc_bitmap_free(reserved);
+    return (-1);
+}
+
+int mochi_plumber_release_progress_core(const char* cpuset)
+{
+    hwloc_cpuset_t      set;
+    struct reservation* res;
+    int                 nres;
+    int                 fd;
+    int                 ret;
+    int                 i;
+    int                 n = 0;
+    char                name[32];
+
+    set = hwloc_bitmap_alloc();
+    assert(set);
+    ret = hwloc_bitmap_list_sscanf(set, cpuset);
+    if (ret < 0 || hwloc_bitmap_iszero(set)) {
+        hwloc_bitmap_free(set);
+        return (-1);
+    }
+    /* recorded as mochi_plumber_get_progress_core() printed it */
+    hwloc_bitmap_list_snprintf(name, sizeof(name), set);
+    hwloc_bitmap_free(set);
+
+    fd = open_reservations("progress", &res, &nres);
+    if (fd < 0) return (-1);
+    for (i = 0; i < nres; i++) {
+        if (res[i].pid != getpid() || strcmp(res[i].name, name) != 0)
+            res[n++] = res[i];
+    }
+    /* always write back, which also drops entries from dead processes */
+    ret = close_reservations(fd, 1, res, n);
+    free(res);
+
+    return (ret);
+}
+
+int mochi_plumber_plan_node(int                              num_ranks,
+                            int                              threads_per_rank,
+                            struct mochi_plumber_placement** placements)
+{
+    struct nic_table*               table;
+    struct mochi_plumber_placement* p;
+    hwloc_cpuset_t*                 sets;
+    hwloc_cpuset_t                  cpuset;
+    hwloc_nodeset_t                 nodeset;
+    hwloc_obj_t                     root;
+    hwloc_obj_t                     core;
+    int*                            assignment = NULL;
+    int                             ncores;
+    int                             ret;
+    int                             i;
+    int                             j;
+
+    if (num_ranks < 1 || threads_per_rank < 1) return (-1);
+
+    ret = get_nic_table(&table);
+    if (ret != 0) return (-1);
+
+    /* ranks may not share cores, and hwloc_distrib() would let them */
+    ncores = hwloc_get_nbobjs_by_type(table->topology, HWLOC_OBJ_CORE);
+    if (ncores < num_ranks * threads_per_rank) {
+        fprintf(stderr,
+                "Error: %d ranks of %d threads oversubscribe the node's %d "
+                "cores.\n",
+                num_ranks, threads_per_rank, ncores);
+        return (-1);
+    }
+
+    p    = calloc(num_ranks, sizeof(*p));
+    sets = calloc(num_ranks, sizeof(*sets));
+    assert(p && sets);
+    for (i = 0; i < num_ranks; i++) {
+        sets[i] = hwloc_bitmap_alloc();
+        assert(sets[i]);
+    }
+    cpuset  = hwloc_bitmap_alloc();
+    nodeset = hwloc_bitmap_alloc();
+    assert(cpuset && nodeset);
+
+    /* spread the ranks evenly over the whole node, down to core level */
+    root = hwloc_get_root_obj(table->topology);
+    ret  = hwloc_distrib(
+        table->topology, &root, 1, sets, num_ranks,
+        hwloc_get_type_or_below_depth(table->topology, HWLOC_OBJ_CORE), 0);
+    if (ret < 0) {
+        fprintf(stderr, "Error: hwloc_distrib() failure.\n");
+        goto error;
+    }
+
+    for (i = 0; i < num_ranks; i++) {
+        /* trim each rank's share down to the cores its threads need */
+        ncores = hwloc_get_nbobjs_inside_cpuset_by_type(
+            table->topology, sets[i], HWLOC_OBJ_CORE);
+        if (ncores < threads_per_rank) {
+            fprintf(stderr,
+                    "Error: rank %d of %d gets only %d cores for %d "
+                    "threads.\n",
+                    i, num_ranks, ncores, threads_per_rank);
+            goto error;
+        }
+        if (ncores > threads_per_rank) {
+            hwloc_bitmap_zero(cpuset);
+            for (j = 0; j < threads_per_rank; j++) {
+                core = hwloc_get_obj_inside_cpuset_by_type(
+                    table->topology, sets[i], HWLOC_OBJ_CORE, j);
+                hwloc_bitmap_or(cpuset, cpuset, core->cpuset);
+            }
+            hwloc_bitmap_copy(sets[i], cpuset);
+        }
+
+        hwloc_cpuset_to_nodeset(table->topology, sets[i], nodeset);
+        p[i].numa = hwloc_bitmap_first(nodeset);
+
+        if (hwloc_bitmap_list_asprintf(&p[i].cpuset, sets[i]) < 0
+            || hwloc_bitmap_taskset_asprintf(&p[i].cpu_mask, sets[i]) < 0)
+            goto error;
+    }
+
+    /* give every rank a NIC, balanced over the node, at the least total
+     * distance
+     */
+    if (table->num_nics > 0) {
+        assignment = malloc(num_ranks * sizeof(*assignment));
+        assert(assignment);
+        ret = match_ranks(table, num_ranks, (hwloc_const_cpuset_t*)sets, 0,
+                          assignment);
+        if (ret < 0) goto error;
+        for (i = 0; i < num_ranks; i++) {
+            p[i].nic = strdup(table->nics[assignment[i]].name);
+            assert(p[i].nic);
+        }
+    }
+
+    for (i = 0; i < num_ranks; i++) hwloc_bitmap_free(sets[i]);
+    free(sets);
+    free(assignment);
+    hwloc_bitmap_free(cpuset);
+    hwloc_bitmap_free(nodeset);
+
+    *placements = p;
+    return (0);
+
+error:
+    for (i = 0; i < num_ranks; i++) hwloc_bitmap_free(sets[i]);
+    free(sets);
+    free(assignment);
+    hwloc_bitmap_free(cpuset);
+    hwloc_bitmap_free(nodeset);
+    mochi_plumber_plan_free(num_ranks, p);
+    return (-1);
+}
+
+void mochi_plumber_plan_free(int                             num_ranks,
+                             struct mochi_plumber_placement* placements)
+{
+    int i;
+
+    if (!placements) return;
+
+    for (i = 0; i < num_ranks; i++) {
+        free(placements[i].cpuset);
+        free(placements[i].cpu_mask);
+        free(placements[i].nic);
+    }
+    free(placements);
+
+    return;
+}
+
+void mochi_plumber_set_local_rank_fn(mochi_plumber_local_rank_fn fn, void* arg)
+{
+    g_local_rank_fn  = fn;
+    g_local_rank_arg = arg;
+
+    return;
+}
+
+int mochi_plumber_match_ranks(int                num_ranks,
+                              const char* const* cpusets,
+                              int                capacity,
+                              char**             out_nics)
+{
+    struct nic_table* table;
+    hwloc_cpuset_t*   sets;
+    int*              assignment;
+    int               ret;
+    int               i;
+
+    if (num_ranks < 1) return (-1);
+
+    ret = get_nic_table(&table);
+    if (ret != 0) return (-1);
+    if (table->num_nics < 1) {
+        fprintf(stderr, "Error: no NICs found.\n");
+        return (-1);
+    }
+
+    sets       = calloc(num_ranks, sizeof(*sets));
+    assignment = malloc(num_ranks * sizeof(*assignment));
+    assert(sets && assignment);
+    for (i = 0; i < num_ranks; i++) {
+        sets[i] = hwloc_bitmap_alloc();
+        assert(sets[i]);
+        if (strncmp(cpusets[i], "0x", strlen("0x")) == 0)
+            ret = hwloc_bitmap_sscanf(sets[i], cpusets[i]);
+        else
+            ret = hwloc_bitmap_list_sscanf(sets[i], cpusets[i]);
+        if (ret < 0) {
+            fprintf(stderr, "Error: invalid cpuset \"%s\".\n", cpusets[i]);
+            goto out;
+        }
+    }
+
+    ret = match_ranks(table, num_ranks, (hwloc_const_cpuset_t*)sets, capacity,
+                      assignment);
+    if (ret < 0) goto out;
+
+    for (i = 0; i < num_ranks; i++) {
+        out_nics[i] = strdup(table->nics[assignment[i]].name);
+        assert(out_nics[i]);
+    }
+
+out:
+    for (i = 0; i < num_ranks; i++) hwloc_bitmap_free(sets[i]);
+    free(sets);
+    free(assignment);
+
+    return (ret < 0 ? -1 : 0);
+}
+
+static int select_nic(enum bucket_policy bucket_policy,
+                      struct selection*  sel,
+                      const char**       out_nic)
+{
+    const struct nic_policy* nic_policy = sel->level->nic;
+    struct bucket*           buckets    = sel->buckets;
+    int                      bucket_idx;
+
+    bucket_idx = choose_bucket(bucket_policy, sel);
+    if (bucket_idx < 0) return (-1);
+    sel->bucket_idx = bucket_idx;
+
+    /* e.g. every local rank must take part in the rendezvous, whichever
+     * bucket it would have drawn from; the bucket is still chosen above
+     * for the policy to fall back on
+     */
+    if (nic_policy->flags & NIC_POLICY_NODE_WIDE)
+        return (nic_policy->select(sel, out_nic));
+
+    /* select a NIC from within the chosen bucket */
+    if (buckets[bucket_idx].num_nics == 1
+        && !(nic_policy->flags & NIC_POLICY_LEASES)) {
+        *out_nic = buckets[bucket_idx].nics[0];
+        return (0);
+    }
+
+    return (nic_policy->select(sel, out_nic));
+}
+
+/* Return the NIC that the service had when it last resolved on this node,
+ * if it is still usable: libfabric still lists it, with its link not down
+ * (as of this process's discovery), it is not excluded or partitioned
+ * away, and it is in the caller's bucket; otherwise -1, to fall back to
+ * the NIC policy.
+ */
+static int select_nic_sticky(enum bucket_policy      bucket_policy,
+                             const struct selection* sel,
+                             const char**            out_nic)
+{
+    struct sticky_entry entry;
+    char                service_id[sizeof(entry.service_id)];
+    struct bucket*      bucket;
+    struct nic_table*   table;
+    int                 nic_idx;
+    int                 fd;
+    int                 found = 0;
+    int                 i     = 0;
+
+    /* ids are stored truncated */
+    snprintf(service_id, sizeof(service_id), "%s", sel->service_id);
+
+    fd = open_state_file("sticky", 0);
+    if (fd < 0) return (-1);
+    flock(fd, LOCK_SH);
+    while (!found
+           && pread(fd, &entry, sizeof(entry), i++ * sizeof(entry))
+                  == sizeof(entry)) {
+        /* others in the group can write the file */
+        entry.service_id[sizeof(entry.service_id) - 1] = '\0';
+        entry.nic[sizeof(entry.nic) - 1]               = '\0';
+        found = strcmp(entry.service_id, service_id) == 0;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (!found) return (-1);
+
+    if (get_nic_table(&table) != 0) return (-1);
+    nic_idx = find_nic(table, entry.nic);
+    if (nic_idx < 0 || table->nics[nic_idx].link_down) return (-1);
+
+    i = sel->nbuckets == 1 ? 0 : choose_bucket(bucket_policy, sel);
+    if (i < 0) return (-1);
+    bucket = &sel->buckets[i];
+    for (i = 0; i < bucket->num_nics; i++) {
+        if (strcmp(bucket->nics[i], entry.nic) == 0) {
+            *out_nic = bucket->nics[i];
+            return (0);
+        }
+    }
+
+    return (-1);
+}
+
+/* record (or update) the NIC that a service resolved to */
+static int record_sticky_nic(const char* service_id, const char* nic)
+{
+    struct sticky_entry entry;
+    struct sticky_entry new_entry = {0};
+    int                 fd;
+    int                 ret;
+    int                 i;
+
+    snprintf(new_entry.service_id, sizeof(new_entry.service_id), "%s",
+             service_id);
+    snprintf(new_entry.nic, sizeof(new_entry.nic), "%s", nic);
+
+    fd = open_state_file("sticky", 0);
+    if (fd < 0) return (-1);
+    flock(fd, LOCK_EX);
+    /* overwrite the service's entry, or append one */
+    for (i = 0;
+         pread(fd, &entry, sizeof(entry), i * sizeof(entry)) == sizeof(entry);
+         i++) {
+        entry.service_id[sizeof(entry.service_id) - 1] = '\0';
+        if (strcmp(entry.service_id, new_entry.service_id) == 0) break;
+    }
+    ret = pwrite(fd, &new_entry, sizeof(new_entry), i * sizeof(new_entry));
+    if (ret < 0) perror("pwrite");
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    return (ret < 0 ? -1 : 0);
+}
+
+/* the bucket for the caller to draw from, or -1 on error */
+static int choose_bucket(enum bucket_policy      bucket_policy,
+                         const struct selection* sel)
+{
+    hwloc_topology_t*      topology   = sel->topology;
+    const struct location* target     = sel->target;
+    int                    nbuckets   = sel->nbuckets;
+    int                    bucket_idx = 0;
+    int                    ret;
+    hwloc_cpuset_t         last_cpu;
+    hwloc_nodeset_t        last_numa;
+    hwloc_obj_t            package;
+    hwloc_obj_t            pu;
+
+    /* figure out which bucket to draw from */
+    if (nbuckets == 1)
+        bucket_idx = 0;
+    else {
+        if (bucket_policy == BUCKET_NUMA) {
+            last_cpu  = hwloc_bitmap_alloc();
+            last_numa = hwloc_bitmap_alloc();
+            assert(last_cpu && last_numa);
+
+            /* select a bucket based on the numa domain that this process is
+             * executing in (or that the caller asked about)
+             */
+            if (target)
+                hwloc_bitmap_copy(last_numa, target->nodeset);
+            else {
+                ret = hwloc_get_last_cpu_location(*topology, last_cpu,
+                                                  HWLOC_CPUBIND_THREAD);
+                if (ret < 0) {
+                    hwloc_bitmap_free(last_cpu);
+                    hwloc_bitmap_free(last_numa);
+                    fprintf(stderr,
+                            "hwloc_get_last_cpu_location() failure.\n");
+                    return (-1);
+                }
+                hwloc_cpuset_to_nodeset(*topology, last_cpu, last_numa);
+            }
+            bucket_idx = hwloc_bitmap_first(last_numa);
+            assert(bucket_idx < nbuckets);
+
+            hwloc_bitmap_free(last_cpu);
+            hwloc_bitmap_free(last_numa);
+        } else if (bucket_policy == BUCKET_PACKAGE) {
+            last_cpu = hwloc_bitmap_alloc();
+            assert(last_cpu);
+
+            /* select a bucket based on the package that this process is
+             * executing in (or that the caller asked about)
+             */
+            if (target)
+                hwloc_bitmap_copy(last_cpu, target->cpuset);
+            else {
+                ret = hwloc_get_last_cpu_location(*topology, last_cpu,
+                                                  HWLOC_CPUBIND_THREAD);
+                if (ret < 0) {
+                    hwloc_bitmap_free(last_cpu);
+                    fprintf(stderr,
+                            "hwloc_get_last_cpu_location() failure.\n");
+                    return (-1);
+                }
+            }
+            /* an explicit target may span packages or have no PUs at all
+             * (CPU-less NUMA node); use its first PU, or its first NUMA
+             * node, to pick a package.
+             */
+            if (!hwloc_bitmap_iszero(last_cpu))
+                pu = hwloc_get_pu_obj_by_os_index(
+                    *topology, hwloc_bitmap_first(last_cpu));
+            else
+                pu = hwloc_get_numanode_obj_by_os_index(
+                    *topology, hwloc_bitmap_first(target->nodeset));
+            package = NULL;
+            if (pu)
+                package = hwloc_get_ancestor_obj_by_type(
+                    *topology, HWLOC_OBJ_PACKAGE, pu);
+            hwloc_bitmap_free(last_cpu);
+            if (!package) {
+                fprintf(stderr, "Error: unable to find package for %s.\n",
+                        target ? "target location" : "current core");
+                return (-1);
+            }
+
+            bucket_idx = package->os_index;
+            assert(bucket_idx < nbuckets);
+        } else {
+            fprintf(stderr, "Error: inconsistent bucket policy %s.\n",
+                    g_bucket_policies[bucket_policy]);
+            return (-1);
+        }
+    }
+
+    return (bucket_idx);
+}
+
+/* add the PUs that other threads of this process are individually bound
+ * to (e.g. other execution streams) to a cpuset
+ */
+static void add_thread_bindings(hwloc_topology_t topology, hwloc_cpuset_t busy)
+{
+    DIR*           dir;
+    struct dirent* ent;
+    pid_t          self = syscall(SYS_gettid);
+    pid_t          tid;
+    hwloc_cpuset_t process;
+    hwloc_cpuset_t set;
+
+    dir = opendir("/proc/self/task");
+    if (!dir) return;
+
+    process = hwloc_bitmap_alloc();
+    set     = hwloc_bitmap_alloc();
+    assert(process && set);
+    if (hwloc_get_cpubind(topology, process, HWLOC_CPUBIND_PROCESS) < 0)
+        hwloc_bitmap_copy(process, hwloc_topology_get_allowed_cpuset(topology));
+
+    while ((ent = readdir(dir))) {
+        tid = atoi(ent->d_name);
+        if (tid <= 0 || tid == self) continue;
+        if (hwloc_linux_get_tid_cpubind(topology, tid, set) < 0) continue;
+        /* a thread that may run anywhere the process can is not bound */
+        if (hwloc_bitmap_isincluded(process, set)) continue;
+        hwloc_bitmap_or(busy, busy, set);
+    }
+    closedir(dir);
+
+    hwloc_bitmap_free(process);
+    hwloc_bitmap_free(set);
+
+    return;
+}
+
+/* Choose a progress core among the allowed PUs: preferably a whole physical
+ * core with nothing busy on it, otherwise a single idle PU, otherwise
+ * (everything is busy) a PU to share.  Searches from the highest index
+ * down, since ranks and their workers are usually bound from the bottom.
+ */
+static void pick_progress_core(hwloc_topology_t     topology,
+                               hwloc_const_cpuset_t allowed,
+                               hwloc_const_cpuset_t busy,
+                               int                  flags,
+                               hwloc_cpuset_t       chosen)
+{
+    hwloc_obj_t obj;
+    int         n;
+    int         i;
+
+    n = hwloc_get_nbobjs_inside_cpuset_by_type(topology, allowed,
+                                               HWLOC_OBJ_CORE);
+    for (i = n - 1; i >= 0; i--) {
+        obj = hwloc_get_obj_inside_cpuset_by_type(topology, allowed,
+                                                  HWLOC_OBJ_CORE, i);
+        if (!hwloc_bitmap_intersects(obj->cpuset, busy)) {
+            if (flags & MOCHI_PLUMBER_PROGRESS_PU)
+                hwloc_bitmap_only(chosen, hwloc_bitmap_first(obj->cpuset));
+            else
+                hwloc_bitmap_copy(chosen, obj->cpuset);
+            return;
+        }
+    }
+
+    n = hwloc_get_nbobjs_inside_cpuset_by_type(topology, allowed,
+                                               HWLOC_OBJ_PU);
+    for (i = n - 1; i >= 0; i--) {
+        obj = hwloc_get_obj_inside_cpuset_by_type(topology, allowed,
+                                                  HWLOC_OBJ_PU, i);
+        if (!hwloc_bitmap_isset(busy, obj->os_index)) {
+            hwloc_bitmap_only(chosen, obj->os_index);
+            return;
+        }
+    }
+
+    hwloc_bitmap_only(chosen, hwloc_bitmap_last(allowed));
+
+    return;
+}
+
+/* Directory for state shared between processes on the node: a per-user
+ * directory in /tmp by default, or, if MOCHI_PLUMBER_SHARED_DIR names one
+ * (e.g. set up by an administrator in /dev/shm, writable by a group or by
+ * everyone), a directory shared by all users' jobs so that they balance
+ * against each other.
+ */
+static int get_state_dir(char* path, size_t len)
+{
+    const char* user = getlogin();
+    const char* shared;
+    char        uid_str[32];
+    int         ret;
+
+    shared = getenv("MOCHI_PLUMBER_SHARED_DIR");
+    if (shared && *shared) {
+        snprintf(path, len, "%s", shared);
+        return (0);
+    }
+
+    if (!user) {
+        /* no controlling terminal (e.g. under a batch launcher) */
+        snprintf(uid_str, sizeof(uid_str), "%d", (int)getuid());
+        user = uid_str;
+    }
+
+    snprintf(path, len, "/tmp/%s-mochi-plumber", user);
+    ret = mkdir(path, 0700);
+    if (ret != 0 && errno != EEXIST) {
+        perror("mkdir");
+        fprintf(stderr, "Error: failed to create %s\n", path);
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* Open (creating if needed) a file in the state directory.  New files get
+ * the directory's read/write permissions, so that a shared directory stays
+ * usable by the other users that it is shared with.  Symbolic links are not
+ * followed, and an existing file must belong to the caller's user or one of
+ * its groups, so that another user of a shared directory can't point our
+ * state at a file of theirs.
+ */
+static int open_state_file(const char* name, int flags)
+{
+    char        path[256];
+    struct stat st;
+    int         fd;
+    int         ret;
+
+    ret = get_state_dir(path, sizeof(path));
+    if (ret < 0) return (-1);
+    ret = stat(path, &st);
+    if (ret < 0) {
+        perror("stat");
+        fprintf(stderr, "Error: failed to access %s\n", path);
+        return (-1);
+    }
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s", name);
+
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | flags, 0600);
+    if (fd >= 0)
+        fchmod(fd, st.st_mode & 0666);
+    else if (errno == EEXIST)
+        fd = open(path, O_RDWR | O_NOFOLLOW | flags);
+    if (fd < 0) {
+        perror("open");
+        fprintf(stderr, "Error: failed to open %s\n", path);
+        return (-1);
+    }
+
+    if (fstat(fd, &st) < 0 || !trusted_state_file(&st)) {
+        fprintf(stderr,
+                "Error: %s is not a file of this user or its groups.\n",
+                path);
+        close(fd);
+        return (-1);
+    }
+
+    return (fd);
+}
+
+static int trusted_state_file(const struct stat* st)
+{
+    gid_t* groups;
+    int    ngroups;
+    int    found = 0;
+    int    i;
+
+    if (!S_ISREG(st->st_mode)) return (0);
+    if (st->st_uid == getuid() || st->st_gid == getgid()) return (1);
+
+    ngroups = getgroups(0, NULL);
+    if (ngroups <= 0) return (0);
+    groups = calloc(ngroups, sizeof(*groups));
+    assert(groups);
+    ngroups = getgroups(ngroups, groups);
+    for (i = 0; i < ngroups && !found; i++) found = groups[i] == st->st_gid;
+    free(groups);
+
+    return (found);
+}
+
+/* start time of a process (in clock ticks since boot), used together with
+ * the pid to tell a live process from a recycled pid; 0 if not found
+ */
+static unsigned long long proc_start_time(pid_t pid)
+{
+    char               path[64];
+    char               buf[1024];
+    char*              p;
+    FILE*              f;
+    unsigned long long start = 0;
+    int                field;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    f = fopen(path, "r");
+    if (!f) return (0);
+    if (!fgets(buf, sizeof(buf), f)) {
+        fclose(f);
+        return (0);
+    }
+    fclose(f);
+
+    /* the command name may contain spaces; count fields after its ')' */
+    p = strrchr(buf, ')');
+    if (!p) return (0);
+    for (field = 2; p && field < 22; field++) p = strchr(p + 1, ' ');
+    if (p) start = strtoull(p + 1, NULL, 10);
+
+    return (start);
+}
+
+/* Is the process that recorded start_time still running?  Start times can't
+ * be read for other users' processes where /proc is mounted with hidepid;
+ * those count as alive as long as the pid exists.
+ */
+static int proc_alive(pid_t pid, unsigned long long start_time)
+{
+    unsigned long long start = proc_start_time(pid);
+
+    if (start) return (start == start_time);
+    return (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/* Open (creating if needed) and lock a reservation file in the state
+ * directory, and read back the reservations still held by live processes.
+ * Returns the locked file descriptor, to be passed to
+ * close_reservations().
+ */
+static int open_reservations(const char*          name,
+                             struct reservation** res,
+                             int*                 nres)
+{
+    struct stat st;
+    int         fd;
+    int         ret;
+    int         i;
+    int         n = 0;
+
+    *res  = NULL;
+    *nres = 0;
+
+    fd = open_state_file(name, 0);
+    if (fd < 0) return (-1);
+    flock(fd, LOCK_EX);
+
+    ret = fstat(fd, &st);
+    if (ret == 0 && st.st_size >= (off_t)sizeof(**res)) {
+        *res = malloc(st.st_size);
+        assert(*res);
+        ret = pread(fd, *res, st.st_size, 0);
+        if (ret < 0) {
+            perror("pread");
+            free(*res);
+            *res = NULL;
+            ret  = 0;
+        }
+        *nres = ret / sizeof(**res);
+    }
+
+    /* reclaim anything held by processes that have since gone away */
+    for (i = 0; i < *nres; i++) {
+        if (proc_alive((*res)[i].pid, (*res)[i].start_time))
+            (*res)[n++] = (*res)[i];
+    }
+    *nres = n;
+
+    return (fd);
+}
+
+/* write back the nres reservations in res (if write_back is set), unlock
+ * and close a reservation file
+ */
+static int close_reservations(int                 fd,
+                              int                 write_back,
+                              struct reservation* res,
+                              int                 nres)
+{
+    int ret = 0;
+
+    if (write_back) {
+        if (ftruncate(fd, 0) < 0
+            || pwrite(fd, res, nres * sizeof(*res), 0) < 0) {
+            perror("pwrite");
+            ret = -1;
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    return (ret);
+}
+
+static int select_nic_roundrobin(const struct selection* sel,
+                                 const char**            out_nic)
+{
+    struct bucket* bucket = &sel->buckets[sel->bucket_idx];
+    int            ret;
+    char           name[32];
+    int            nic_idx;
+
+    snprintf(name, sizeof(name), "%d", sel->bucket_idx);
+    ret = next_counter(name, bucket->num_nics, &nic_idx);
+    if (ret < 0) return (-1);
+
+    *out_nic = bucket->nics[nic_idx];
+    return (0);
+}
+
+/* Advance a counter kept in a state file, shared by all processes using the
+ * state directory, and return its new value modulo modulus.
+ */
+static int next_counter(const char* name, int modulus, int* value)
+{
+    int ret;
+    int fd;
+    int idx = -1;
+
+    fd = open_state_file(name, O_SYNC);
+    if (fd < 0) return (-1);
+
+    /* exlusive lock file */
+    flock(fd, LOCK_EX);
+
+    /* read most recently used value */
+    /* note: if value hasn't been set yet (pread returns 0), idx was
+     * initialized to -1
+     */
+    ret = pread(fd, &idx, sizeof(idx), 0);
+    if (ret < 0) {
+        perror("pread");
+        fprintf(stderr, "Error: failed to read %s\n", name);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return (-1);
+    }
+    /* select next value */
+    idx = (idx + 1) % modulus;
+    /* write selection back to file */
+    ret = pwrite(fd, &idx, sizeof(idx), 0);
+    if (ret < 0) {
+        perror("pwrite");
+        fprintf(stderr, "Error: failed to write %s\n", name);
+        flock(fd, LOCK_UN);
+        close(fd);
+        return (-1);
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+
+    *value = idx;
+    return (0);
+}
+
+static int select_nic_random(const struct selection* sel, const char** out_nic)
+{
+    struct bucket* bucket  = &sel->buckets[sel->bucket_idx];
+    int            nic_idx = -1;
+
+    /* we only need to worry about unique seeding within a single node, so
+     * its sufficient to just use the pid
+     */
+    srand(getpid());
+    nic_idx = rand() % bucket->num_nics;
+
+    *out_nic = bucket->nics[nic_idx];
+    return (0);
+}
+
+static int select_nic_weighted_roundrobin(const struct selection* sel,
+                                          const char**            out_nic)
+{
+    return (select_nic_weighted(sel, 0, out_nic));
+}
+
+static int select_nic_weighted_random(const struct selection* sel,
+                                      const char**            out_nic)
+{
+    return (select_nic_weighted(sel, 1, out_nic));
+}
+
+/* Round robin or random selection in proportion to per-NIC weights
+ * ("cxi0=1,cxi1=3"; NICs not listed weigh 1, and 0 leaves a NIC out).
+ * Round robin interleaves the NICs by smooth weighted round robin (cxi1
+ * cxi0 cxi1 cxi1 ...), with the per-NIC credits shared through the state
+ * directory.
+ */
+static int select_nic_weighted(const struct selection* sel,
+                               int                     random,
+                               const char**            out_nic)
+{
+    struct bucket* bucket = &sel->buckets[sel->bucket_idx];
+    char           name[32];
+    int*           w;
+    int            total;
+    int            step;
+    int            nic_idx = 0;
+    int            ret;
+
+    w = malloc(bucket->num_nics * sizeof(*w));
+    assert(w);
+    total = parse_weights(sel->weights, bucket, w);
+    if (total < 0) {
+        free(w);
+        return (-1);
+    }
+
+    if (random) {
+        srand(getpid());
+        step = rand() % total;
+        for (nic_idx = 0; step >= w[nic_idx]; nic_idx++) step -= w[nic_idx];
+    } else {
+        snprintf(name, sizeof(name), "w%d", sel->bucket_idx);
+        ret = next_weighted(name, bucket->num_nics, w, total, &nic_idx);
+        if (ret < 0) {
+            free(w);
+            return (-1);
+        }
+    }
+    free(w);
+
+    *out_nic = bucket->nics[nic_idx];
+    return (0);
+}
+
+/* One step of smooth weighted round robin over credits kept in a state
+ * file, shared by all processes using the state directory: every NIC earns
+ * its weight, and the NIC with the most credit is picked and pays the
+ * total.  Credits that don't fit the weights (another NIC count, or a file
+ * from elsewhere) are started afresh.
+ */
+static int next_weighted(const char* name,
+                         int         num_nics,
+                         const int*  w,
+                         int         total,
+                         int*        nic_idx)
+{
+    long long* credit;
+    long long  sum = 0;
+    ssize_t    len = num_nics * sizeof(*credit);
+    int        fd;
+    int        ret = 0;
+    int        i;
+
+    credit = calloc(num_nics, sizeof(*credit));
+    assert(credit);
+
+    fd = open_state_file(name, O_SYNC);
+    if (fd < 0) {
+        free(credit);
+        return (-1);
+    }
+    flock(fd, LOCK_EX);
+
+    /* credits always sum to 0, and none strays further than the total */
+    if (pread(fd, credit, len, 0) == len) {
+        for (i = 0; i < num_nics; i++) {
+            sum += credit[i];
+            if (credit[i] > total || credit[i] < -(long long)total) break;
+        }
+        if (i < num_nics || sum != 0) memset(credit, 0, len);
+    } else
+        memset(credit, 0, len);
+
+    *nic_idx = 0;
+    for (i = 0; i < num_nics; i++) {
+        credit[i] += w[i];
+        if (credit[i] > credit[*nic_idx]) *nic_idx = i;
+    }
+    credit[*nic_idx] -= total;
+
+    if (pwrite(fd, credit, len, 0) != len) {
+        perror("pwrite");
+        fprintf(stderr, "Error: failed to write %s\n", name);
+        ret = -1;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    free(credit);
+
+    return (ret);
+}
+
+/* Fill in w with the weight of each of the bucket's NICs and return the
+ * total, or -1 if the weights string is malformed or a weight is larger
+ * than MAX_NIC_WEIGHT.  If every NIC weighs 0, they are all weighted
+ * equally.
+ */
+static int parse_weights(const char* weights, struct bucket* bucket, int* w)
+{
+    const char* p = weights;
+    char*       end;
+    size_t      len;
+    long        val;
+    int         total = 0;
+    int         i;
+
+    for (i = 0; i < bucket->num_nics; i++) w[i] = 1;
+
+    while (p && *p) {
+        len = strcspn(p, "=");
+        if (p[len] != '=') goto error;
+        val = strtol(p + len + 1, &end, 10);
+        if (end == p + len + 1 || val < 0 || val > MAX_NIC_WEIGHT
+            || (*end && *end != ','))
+            goto error;
+        for (i = 0; i < bucket->num_nics; i++) {
+            if (strlen(bucket->nics[i]) == len
+                && strncmp(bucket->nics[i], p, len) == 0)
+                w[i] = val;
+        }
+        p = *end ? end + 1 : end;
+    }
+
+    for (i = 0; i < bucket->num_nics; i++) total += w[i];
+    if (total == 0) {
+        for (i = 0; i < bucket->num_nics; i++) w[i] = 1;
+        total = bucket->num_nics;
+    }
+    return (total);
+
+error:
+    fprintf(stderr, "Error: invalid NIC weights \"%s\".\n", weights);
+    return (-1);
+}
+
+/* the NIC with the fewest live leases (see acquire_lease()) */
+static int select_nic_leastused(const struct selection* sel,
+                                const char**            out_nic)
+{
+    return (acquire_lease(sel->nbuckets, sel->buckets,
+                          &sel->buckets[sel->bucket_idx], sel->target,
+                          out_nic));
+}
+
+/* Parse one NIC policy of a chain, the len characters at spec: "<name>"
+ * or, for policies that take them, "<name>:<parameters>".
+ */
+static int parse_nic_level(const char*       spec,
+                           size_t            len,
+                           struct nic_level* level)
+{
+    size_t name_len;
+    char*  params = NULL;
+    int    i;
+
+    name_len = strcspn(spec, ":>");
+    if (name_len > len) name_len = len;
+    for (i = 0; g_nic_policies[i].name; i++) {
+        if (strlen(g_nic_policies[i].name) == name_len
+            && strncmp(spec, g_nic_policies[i].name, name_len) == 0)
+            break;
+    }
+    level->nic = &g_nic_policies[i];
+    if (!level->nic->name
+        || (name_len < len
+            && !(level->nic->flags
+                 & (NIC_POLICY_WEIGHTS | NIC_POLICY_PLUGIN | NIC_POLICY_KEY
+                    | NIC_POLICY_PLACEMENT)))
+        || (name_len == len && (level->nic->flags & NIC_POLICY_PLUGIN)))
+        return (MOCHI_PLUMBER_ERR_NIC_POLICY);
+    if (name_len == len) return (0);
+
+    params = strndup(spec + name_len + 1, len - name_len - 1);
+    if (!params) return (-1);
+    if (level->nic->flags & NIC_POLICY_PLUGIN) {
+        i = load_plugin(level, params);
+        free(params);
+        return (i < 0 ? MOCHI_PLUMBER_ERR_NIC_POLICY : 0);
+    }
+    level->param = params;
+    /* check the syntax now rather than at every resolution */
+    if (level->nic->flags & NIC_POLICY_KEY) {
+        if (strcmp(params, "rank") != 0 && strcmp(params, "core") != 0
+            && strcmp(params, "service") != 0)
+            return (MOCHI_PLUMBER_ERR_NIC_POLICY);
+    } else if (level->nic->flags & NIC_POLICY_PLACEMENT) {
+        if (strcmp(params, "block") != 0 && strcmp(params, "cyclic") != 0)
+            return (MOCHI_PLUMBER_ERR_NIC_POLICY);
+    } else if (parse_weights(level->param, &(struct bucket){0}, NULL) < 0)
+        return (MOCHI_PLUMBER_ERR_NIC_POLICY);
+    return (0);
+}
+
+static void release_nic_level(struct nic_level* level)
+{
+    if (level->plugin && level->plugin->finalize)
+        level->plugin->finalize(level->plugin_state);
+    if (level->dl) dlclose(level->dl);
+    free(level->param);
+}
+
+/* Open a plugin given as "<path>[:<parameters>]" (the parameters start at
+ * the first ':' after the last '/') and initialize it for this NIC policy.
+ */
+static int load_plugin(struct nic_level* level, const char* spec)
+{
+    const char* base = strrchr(spec, '/');
+    const char* params;
+    char*       path;
+    int         ret;
+
+    params = strchr(base ? base : spec, ':');
+    path   = strndup(spec, params ? (size_t)(params - spec) : strlen(spec));
+    assert(path);
+    if (params) params++;
+
+    level->dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!level->dl) {
+        fprintf(stderr, "Error: failed to load plugin %s: %s\n", path,
+                dlerror());
+        free(path);
+        return (-1);
+    }
+    level->plugin = dlsym(level->dl, MOCHI_PLUMBER_PLUGIN_SYMBOL);
+    if (!level->plugin || !level->plugin->select
+        || level->plugin->version != MOCHI_PLUMBER_PLUGIN_VERSION) {
+        fprintf(stderr,
+                "Error: %s is not a mochi-plumber plugin of version %d.\n",
+                path, MOCHI_PLUMBER_PLUGIN_VERSION);
+        level->plugin = NULL;
+        free(path);
+        return (-1);
+    }
+    free(path);
+
+    if (level->plugin->init) {
+        ret = level->plugin->init(params, &level->plugin_state);
+        if (ret != 0) {
+            fprintf(stderr, "Error: plugin %s failed to initialize.\n",
+                    level->plugin->name);
+            level->plugin = NULL;
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+/* hand the choice to a plugin, with the caller's location */
+static int select_nic_plugin(const struct selection* sel, const char** out_nic)
+{
+    const struct nic_level*            level = sel->level;
+    struct bucket*                     bucket;
+    struct mochi_plumber_plugin_args   args;
+    hwloc_cpuset_t                     cpuset;
+    hwloc_nodeset_t                    nodeset;
+    int                                nic_idx = -1;
+    int                                ret;
+
+    cpuset  = hwloc_bitmap_alloc();
+    nodeset = hwloc_bitmap_alloc();
+    assert(cpuset && nodeset);
+    if (sel->target) {
+        hwloc_bitmap_copy(cpuset, sel->target->cpuset);
+        hwloc_bitmap_copy(nodeset, sel->target->nodeset);
+    } else {
+        ret = hwloc_get_last_cpu_location(*sel->topology, cpuset,
+                                          HWLOC_CPUBIND_THREAD);
+        if (ret < 0)
+            hwloc_bitmap_copy(cpuset, hwloc_topology_get_allowed_cpuset(
+                                          *sel->topology));
+        hwloc_cpuset_to_nodeset(*sel->topology, cpuset, nodeset);
+    }
+
+    args.topology   = *sel->topology;
+    args.cpuset     = cpuset;
+    args.nodeset    = nodeset;
+    args.nbuckets   = sel->nbuckets;
+    args.buckets    = (const struct mochi_plumber_bucket*)sel->buckets;
+    args.bucket_idx = sel->bucket_idx;
+    ret = level->plugin->select(level->plugin_state, &args, &nic_idx);
+    hwloc_bitmap_free(cpuset);
+    hwloc_bitmap_free(nodeset);
+
+    bucket = &sel->buckets[sel->bucket_idx];
+    if (ret != 0 || nic_idx < 0 || nic_idx >= bucket->num_nics) {
+        fprintf(stderr, "Error: plugin %s failed to select a NIC.\n",
+                level->plugin->name);
+        return (-1);
+    }
+
+    *out_nic = bucket->nics[nic_idx];
+    return (0);
+}
+
+/* Rendezvous (highest random weight) hashing of a stable identity: every
+ * NIC gets a score for the key and the highest wins, so removing a NIC
+ * only moves the keys that were on it, and adding one only takes keys for
+ * itself.
+ */
+static int select_nic_hash(const struct selection* sel, const char** out_nic)
+{
+    struct bucket* bucket = &sel->buckets[sel->bucket_idx];
+    char           key[256];
+    int            id;
+    uint64_t       score;
+    uint64_t       best = 0;
+    int            i;
+
+    if (selection_identity(sel, key, sizeof(key), &id) < 0) return (-1);
+
+    *out_nic = bucket->nics[0];
+    for (i = 0; i < bucket->num_nics; i++) {
+        score = string_hash(key, bucket->nics[i]);
+        if (i == 0 || score > best) {
+            best     = score;
+            *out_nic = bucket->nics[i];
+        }
+    }
+
+    return (0);
+}
+
+/* Map the caller's role to the same NIC index on every node, counting the
+ * NICs in PCI address order, so that peers with the same role talk over
+ * the same rail.  Ranks and cores are spread evenly; service ids by hash.
+ */
+static int select_nic_rail(const struct selection* sel, const char** out_nic)
+{
+    struct bucket*    bucket = &sel->buckets[sel->bucket_idx];
+    struct nic_table* table;
+    struct rail_nic*  rails;
+    char              key[256];
+    int               id;
+    int               nic_idx;
+    int               ret;
+    int               i;
+
+    if (selection_identity(sel, key, sizeof(key), &id) < 0) return (-1);
+    ret = get_nic_table(&table);
+    if (ret < 0) return (-1);
+
+    rails = calloc(bucket->num_nics, sizeof(*rails));
+    if (!rails) return (-1);
+    for (i = 0; i < bucket->num_nics; i++) {
+        rails[i].name = bucket->nics[i];
+        nic_idx       = find_nic(table, bucket->nics[i]);
+        if (nic_idx >= 0)
+            rails[i].pci = pci_order(table->nics[nic_idx].pci_dev);
+    }
+    qsort(rails, bucket->num_nics, sizeof(*rails), compare_rails);
+
+    if (id < 0) id = string_hash(key, "rail") % bucket->num_nics;
+    *out_nic = rails[id % bucket->num_nics].name;
+    free(rails);
+
+    return (0);
+}
+
+/* PCI domain:bus:device.function as one sortable number */
+static unsigned long long pci_order(hwloc_obj_t pci_dev)
+{
+    struct hwloc_pcidev_attr_s* pci = &pci_dev->attr->pcidev;
+
+    return (((unsigned long long)pci->domain << 24) | (pci->bus << 16)
+            | (pci->dev << 8) | pci->func);
+}
+
+static int compare_rails(const void* a, const void* b)
+{
+    const struct rail_nic* x = a;
+    const struct rail_nic* y = b;
+
+    if (x->pci != y->pci) return (x->pci < y->pci ? -1 : 1);
+    return (strcmp(x->name, y->name));
+}
+
+/* The caller's stable identity for the "hash" and "rail" policies: the
+ * service id, local rank or core, as given by the policy parameter, or by
+ * default the first of them that is known.  Sets key to e.g. "rank:3" and
+ * *id to the rank or core (-1 for a service id).
+ */
+static int selection_identity(const struct selection* sel,
+                              char*                   key,
+                              size_t                  len,
+                              int*                    id)
+{
+    const char*    kind = sel->level->param;
+    int            local_rank;
+    int            local_size;
+    hwloc_cpuset_t last_cpu;
+    int            ret;
+
+    if (!kind) {
+        if (sel->service_id)
+            kind = "service";
+        else if (get_local_rank(&local_rank, &local_size) == 0)
+            kind = "rank";
+        else
+            kind = "core";
+    }
+
+    if (strcmp(kind, "service") == 0) {
+        if (!sel->service_id) {
+            fprintf(stderr, "Error: %s policy has no service id.\n",
+                    sel->level->nic->name);
+            return (-1);
+        }
+        snprintf(key, len, "service:%s", sel->service_id);
+        *id = -1;
+    } else if (strcmp(kind, "rank") == 0) {
+        ret = get_local_rank(&local_rank, &local_size);
+        if (ret < 0) {
+            fprintf(stderr,
+                    "Error: %s policy could not determine local rank.\n",
+                    sel->level->nic->name);
+            return (-1);
+        }
+        snprintf(key, len, "rank:%d", local_rank);
+        *id = local_rank;
+    } else {
+        /* an explicit target stands in for the core we would be running on
+         */
+        if (sel->target)
+            *id = location_first_index(sel->target);
+        else {
+            last_cpu = hwloc_bitmap_alloc();
+            assert(last_cpu);
+            ret = hwloc_get_last_cpu_location(*sel->topology, last_cpu,
+                                              HWLOC_CPUBIND_THREAD);
+            *id = hwloc_bitmap_first(last_cpu);
+            hwloc_bitmap_free(last_cpu);
+            if (ret < 0) {
+                fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
+                return (-1);
+            }
+        }
+        snprintf(key, len, "core:%d", *id);
+    }
+
+    return (0);
+}
+
+/* FNV-1a of "<a>\0<b>", finished with the splitmix64 mixer so that similar
+ * strings get unrelated hashes
+ */
+static uint64_t string_hash(const char* a, const char* b)
+{
+    uint64_t    h = 14695981039346656037ULL;
+    const char* p;
+
+    for (p = a; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h *= 1099511628211ULL;
+    for (p = b; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return (h);
+}
+
+/* Record a lease by this process on *out_nic in the node-local lease table;
+ * a process holds at most one lease per NIC, so resolving again only keeps
+ * it.  If bucket is not NULL, first choose the bucket's NIC with the fewest
+ * leases, our own included (the first such NIC on a tie), under the same
+ * lock so that concurrent resolutions see each other.  If
+ * MOCHI_PLUMBER_MAX_NIC_USERS caps the processes per NIC, a full NIC is
+ * swapped for the nearest one with room among the buckets' NICs; returns
+ * MOCHI_PLUMBER_ERR_SATURATED if they are all full.
+ */
+static int acquire_lease(int                    nbuckets,
+                         struct bucket*         buckets,
+                         struct bucket*         bucket,
+                         const struct location* target,
+                         const char**           out_nic)
+{
+    struct reservation* res;
+    struct nic_table*   table;
+    const char*         cap;
+    int*                users;
+    int                 nres;
+    int                 fd;
+    int                 ret;
+    int                 nic_idx = 0;
+    int                 i;
+    int                 j;
+
+    fd = open_reservations("leases", &res, &nres);
+    if (fd < 0) return (-1);
+
+    if (bucket) {
+        users = calloc(bucket->num_nics, sizeof(*users));
+        assert(users);
+        for (i = 0; i < nres; i++) {
+            for (j = 0; j < bucket->num_nics; j++) {
+                if (strcmp(res[i].name, bucket->nics[j]) == 0) users[j]++;
+            }
+        }
+        for (j = 1; j < bucket->num_nics; j++) {
+            if (users[j] < users[nic_idx]) nic_idx = j;
+        }
+        free(users);
+        *out_nic = bucket->nics[nic_idx];
+    }
+
+    cap = getenv("MOCHI_PLUMBER_MAX_NIC_USERS");
+    if (cap && *cap) {
+        ret = get_nic_table(&table);
+        if (ret == 0)
+            ret = spill_nic(table, nbuckets, buckets, target, res, nres,
+                            out_nic);
+        if (ret != 0) {
+            close_reservations(fd, 0, NULL, 0);
+            free(res);
+            return (ret);
+        }
+    }
+
+    /* keep the lease we already have on it, if any */
+    for (i = 0; i < nres; i++) {
+        if (res[i].pid == getpid() && strcmp(res[i].name, *out_nic) == 0)
+            break;
+    }
+    if (i == nres) {
+        res = realloc(res, (nres + 1) * sizeof(*res));
+        assert(res);
+        memset(&res[nres], 0, sizeof(*res));
+        res[nres].pid        = getpid();
+        res[nres].start_time = proc_start_time(getpid());
+        snprintf(res[nres].name, sizeof(res[nres].name), "%s", *out_nic);
+        nres++;
+    }
+
+    ret = close_reservations(fd, 1, res, nres);
+    free(res);
+
+    return (ret);
+}
+
+/* Most leases a NIC may hold: MOCHI_PLUMBER_MAX_NIC_USERS, or, if that is
+ * "auto", the number of endpoints the NIC supports; INT_MAX if unlimited.
+ */
+static int nic_user_cap(struct nic_table* table, int nic_idx)
+{
+    const char* cap = getenv("MOCHI_PLUMBER_MAX_NIC_USERS");
+    int         n   = 0;
+
+    if (cap && strcmp(cap, "auto") == 0)
+        n = table->nics[nic_idx].max_eps;
+    else if (cap)
+        n = atoi(cap);
+
+    return (n > 0 ? n : INT_MAX);
+}
+
+/* If *out_nic already has as many other users as its cap, replace it with
+ * the NIC with room (among those in the buckets) that is closest (by NUMA
+ * distance) to the target location or to the calling thread, preferring
+ * the less used on a tie.
+ */
+static int spill_nic(struct nic_table*         table,
+                     int                       nbuckets,
+                     struct bucket*            buckets,
+                     const struct location*    target,
+                     const struct reservation* res,
+                     int                       nres,
+                     const char**              out_nic)
+{
+    hwloc_cpuset_t  cpuset;
+    hwloc_nodeset_t nodeset;
+    int*            users;
+    int             nic_idx;
+    int             best      = -1; /* none found yet */
+    int             best_cost = INT_MAX;
+    int             cost;
+    int             i;
+    int             j;
+
+    /* other processes using each NIC; a lease of our own doesn't count
+     * against the cap again
+     */
+    users = calloc(table->num_nics, sizeof(*users));
+    assert(users);
+    for (i = 0; i < nres; i++) {
+        if (res[i].pid == getpid()) continue;
+        j = find_nic(table, res[i].name);
+        if (j >= 0) users[j]++;
+    }
+
+    nic_idx = find_nic(table, *out_nic);
+    if (nic_idx >= 0 && users[nic_idx] < nic_user_cap(table, nic_idx)) {
+        free(users);
+        return (0);
+    }
+
+    nodeset = hwloc_bitmap_alloc();
+    assert(nodeset);
+    if (target)
+        hwloc_bitmap_copy(nodeset, target->nodeset);
+    else {
+        cpuset = hwloc_bitmap_alloc();
+        assert(cpuset);
+        if (hwloc_get_cpubind(table->topology, cpuset, HWLOC_CPUBIND_THREAD)
+            < 0)
+            hwloc_bitmap_copy(cpuset, hwloc_topology_get_allowed_cpuset(
+                                          table->topology));
+        hwloc_cpuset_to_nodeset(table->topology, cpuset, nodeset);
+        hwloc_bitmap_free(cpuset);
+    }
+
+    for (j = 0; j < table->num_nics; j++) {
+        if (users[j] >= nic_user_cap(table, j)
+            || !in_buckets(nbuckets, buckets, table->nics[j].name))
+            continue;
+        cost = nodeset_nic_cost(table, nodeset, j);
+        if (cost < best_cost
+            || (cost == best_cost && best >= 0 && users[j] < users[best])) {
+            best      = j;
+            best_cost = cost;
+        }
+    }
+    hwloc_bitmap_free(nodeset);
+    free(users);
+
+    if (best < 0) {
+        fprintf(stderr, "Error: every NIC has reached its user limit.\n");
+        return (MOCHI_PLUMBER_ERR_SATURATED);
+    }
+    *out_nic = table->nics[best].name;
+
+    return (0);
+}
+
+static int in_buckets(int nbuckets, struct bucket* buckets, const char* nic)
+{
+    int i;
+    int j;
+
+    for (i = 0; i < nbuckets; i++) {
+        for (j = 0; j < buckets[i].num_nics; j++) {
+            if (strcmp(buckets[i].nics[j], nic) == 0) return (1);
+        }
+    }
+
+    return (0);
+}
+
+/* Static mapping based on the local rank reported by the launcher, with no
+ * shared state, so that reruns reproduce the same mapping.  Each rank takes
+ * the NIC given by its position among the ranks that share its bucket, so
+ * that they spread evenly over the bucket's NICs.  This assumes that the
+ * launcher places ranks on the buckets in blocks (ranks 0-3 on the first
+ * package and 4-7 on the second), as Cray PALS does by default, or, with
+ * "byrank:cyclic", cyclically (ranks 0, 2, 4 and 6 on the first package),
+ * as Slurm's default block:cyclic distribution does.
+ */
+static int select_nic_byrank(const struct selection* sel, const char** out_nic)
+{
+    struct bucket* bucket = &sel->buckets[sel->bucket_idx];
+    int            local_rank;
+    int            local_size;
+    int            nbuckets = 0;
+    int            cyclic;
+    int            ret;
+    int            i;
+
+    ret = get_local_rank(&local_rank, &local_size);
+    if (ret < 0) {
+        fprintf(stderr,
+                "Error: byrank policy could not determine local rank.\n");
+        return (-1);
+    }
+
+    /* ranks only spread over the buckets that have NICs to give */
+    for (i = 0; i < sel->nbuckets; i++)
+        if (sel->buckets[i].num_nics > 0) nbuckets++;
+
+    cyclic = sel->level->param && strcmp(sel->level->param, "cyclic") == 0;
+    *out_nic
+        = bucket->nics[byrank_position(local_rank, local_size, nbuckets, cyclic)
+                       % bucket->num_nics];
+    return (0);
+}
+
+/* A rank's position among the ranks placed in the same bucket as it, in
+ * blocks or cyclically.  Block placement needs the local size to tell where
+ * each bucket's ranks start; without it, the rank itself is used.
+ */
+static int byrank_position(int local_rank,
+                           int local_size,
+                           int nbuckets,
+                           int cyclic)
+{
+    if (nbuckets < 1) return (local_rank);
+    if (cyclic) return (local_rank / nbuckets);
+    if (local_size < 1) return (local_rank);
+    return (local_rank % ((local_size + nbuckets - 1) / nbuckets));
+}
+
+/* Node-wide assignment that doesn't depend on the order in which ranks
+ * arrive: every local rank registers its cpuset in a table in /dev/shm and
+ * waits (up to MOCHI_PLUMBER_RENDEZVOUS_TIMEOUT seconds, default 10) for
+ * the others.  The first rank to find the table complete solves the
+ * assignment for all of them with match_ranks() and writes it back, so
+ * every rank reads the same answer; the last rank to read its NIC removes
+ * the table, as does the last rank to give up waiting.  The solver accounts
+ * for locality itself, so the NIC may come from any bucket.  Falls back to
+ * byrank within the caller's own bucket on timeout.  The job id from the
+ * launcher names the table, and may not contain '/'.
+ */
+static int select_nic_rendezvous(const struct selection* sel,
+                                 const char**            out_nic)
+{
+    char        path[256];
+    char        nic[sizeof(g_rendezvous_nic)];
+    const char* job_id;
+    char        ppid_str[32];
+    char        step_id[128];
+    int         local_rank;
+    int         local_size;
+    int         bucket_idx;
+    int         cached;
+    int         ret;
+    int         i;
+
+    ret = get_local_rank(&local_rank, &local_size);
+    if (ret < 0 || local_size < 1) {
+        fprintf(stderr, "Error: rendezvous policy could not determine local "
+                        "rank and size.\n");
+        return (-1);
+    }
+    if (local_rank < 0 || local_rank >= local_size) {
+        fprintf(stderr,
+                "Error: rendezvous policy got local rank %d outside of local "
+                "size %d.\n",
+                local_rank, local_size);
+        return (-1);
+    }
+
+    /* ranks of the same job on this node must agree on the table; without
+     * a job id from the launcher, assume they share a parent (the
+     * launcher's node daemon)
+     */
+    job_id = getenv("MOCHI_PLUMBER_JOB_ID");
+    if (!job_id && getenv("SLURM_JOB_ID") && getenv("SLURM_STEP_ID")) {
+        snprintf(step_id, sizeof(step_id), "%s.%s", getenv("SLURM_JOB_ID"),
+                 getenv("SLURM_STEP_ID"));
+        job_id = step_id;
+    }
+    if (!job_id) job_id = getenv("PALS_APID");
+    if (!job_id) {
+        snprintf(ppid_str, sizeof(ppid_str), "ppid%d", (int)getppid());
+        job_id = ppid_str;
+    }
+    /* the job id is part of a file name in /dev/shm */
+    if (!*job_id || strchr(job_id, '/')) {
+        fprintf(stderr, "Error: invalid rendezvous job id \"%s\".\n", job_id);
+        return (-1);
+    }
+    snprintf(path, sizeof(path), "/dev/shm/mochi-plumber-%d-%s", (int)getuid(),
+             job_id);
+
+    /* resolving again keeps the NIC that the rendezvous gave us */
+    pthread_mutex_lock(&g_rendezvous_mutex);
+    cached = strcmp(g_rendezvous_path, path) == 0;
+    if (cached) snprintf(nic, sizeof(nic), "%s", g_rendezvous_nic);
+    pthread_mutex_unlock(&g_rendezvous_mutex);
+
+    if (!cached) {
+        ret = rendezvous_join(sel, path, local_rank, local_size, nic,
+                              sizeof(nic));
+        if (ret < 0) return (-1);
+        if (ret > 0) {
+            fprintf(stderr,
+                    "Warning: rendezvous with %d local ranks timed out; "
+                    "using byrank.\n",
+                    local_size);
+            return (select_nic_byrank(sel, out_nic));
+        }
+        pthread_mutex_lock(&g_rendezvous_mutex);
+        snprintf(g_rendezvous_path, sizeof(g_rendezvous_path), "%s", path);
+        snprintf(g_rendezvous_nic, sizeof(g_rendezvous_nic), "%s", nic);
+        pthread_mutex_unlock(&g_rendezvous_mutex);
+    }
+
+    /* hand back the bucket's copy of the name */
+    for (bucket_idx = 0; bucket_idx < sel->nbuckets; bucket_idx++) {
+        for (i = 0; i < sel->buckets[bucket_idx].num_nics; i++) {
+            if (strcmp(sel->buckets[bucket_idx].nics[i], nic) == 0) {
+                *out_nic = sel->buckets[bucket_idx].nics[i];
+                return (0);
+            }
+        }
+    }
+
+    fprintf(stderr, "Error: rendezvous assigned unknown NIC %s.\n", nic);
+    return (-1);
+}
+
+/* Take part in the rendezvous in the table at path, and return the NIC
+ * that it assigns us.  Returns 1 if the other ranks don't all register in
+ * time.
+ */
+static int rendezvous_join(const struct selection* sel,
+                           const char*             path,
+                           int                     local_rank,
+                           int                     local_size,
+                           char*                   nic,
+                           size_t                  nic_len)
+{
+    struct rendezvous_header header = {0};
+    struct rendezvous_slot   slot   = {0};
+    const char*              timeout_str;
+    hwloc_cpuset_t           cpuset;
+    time_t                   deadline;
+    off_t                    slot_off;
+    struct stat              st;
+    int                      timed_out;
+    int                      fd;
+    int                      ret;
+
+    timeout_str = getenv("MOCHI_PLUMBER_RENDEZVOUS_TIMEOUT");
+    deadline    = time(NULL) + (timeout_str ? atoi(timeout_str) : 10);
+
+    /* our cpuset: the explicit target if given, otherwise our binding */
+    cpuset = hwloc_bitmap_alloc();
+    assert(cpuset);
+    if (sel->target)
+        hwloc_bitmap_copy(cpuset, sel->target->cpuset);
+    else if (hwloc_get_cpubind(*sel->topology, cpuset, HWLOC_CPUBIND_PROCESS)
+             < 0)
+        hwloc_bitmap_copy(cpuset,
+                          hwloc_topology_get_allowed_cpuset(*sel->topology));
+    slot.pid        = getpid();
+    slot.start_time = proc_start_time(slot.pid);
+    slot.registered = 1;
+    hwloc_bitmap_list_snprintf(slot.cpuset, sizeof(slot.cpuset), cpuset);
+    hwloc_bitmap_free(cpuset);
+
+    /* the path is predictable, so don't follow links and only trust a
+     * regular file that is ours and private to us
+     */
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        perror("open");
+        fprintf(stderr, "Error: failed to open %s\n", path);
+        return (-1);
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()
+        || (st.st_mode & 077)) {
+        fprintf(stderr, "Error: %s is not a private file of this user.\n",
+                path);
+        close(fd);
+        return (-1);
+    }
+    slot_off = sizeof(header) + local_rank * sizeof(slot);
+
+    flock(fd, LOCK_EX);
+    ret = rendezvous_register(fd, local_size, local_rank, &slot);
+    flock(fd, LOCK_UN);
+    if (ret < 0) {
+        close(fd);
+        return (-1);
+    }
+
+    /* wait for the assignment */
+    while (1) {
+        flock(fd, LOCK_EX);
+        ret = pread(fd, &header, sizeof(header), 0);
+        if (ret == sizeof(header) && !header.solved) {
+            ret = rendezvous_solve(fd, local_size, sel);
+            if (ret == 0) header.solved = 1;
+        }
+        if (header.solved)
+            ret = pread(fd, &slot, sizeof(slot), slot_off);
+        /* the last rank to read its NIC cleans up */
+        if (header.solved && ret == sizeof(slot) && !slot.claimed) {
+            slot.claimed = 1;
+            header.claimed++;
+            if (pwrite(fd, &slot, sizeof(slot), slot_off) != sizeof(slot)
+                || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+                perror("pwrite");
+            if (header.claimed == local_size) unlink(path);
+        }
+        /* don't leave a table behind that can never be solved */
+        timed_out = !header.solved && time(NULL) > deadline;
+        if (timed_out) rendezvous_leave(fd, path, local_size, local_rank);
+        flock(fd, LOCK_UN);
+
+        if (header.solved || timed_out) break;
+        usleep(10000);
+    }
+    close(fd);
+
+    if (!header.solved || ret != sizeof(slot)) return (1);
+
+    snprintf(nic, nic_len, "%s", slot.nic);
+    return (0);
+}
+
+/* With the (unsolved) rendezvous table locked, give up on it: withdraw our
+ * slot, so that it can't be solved without us, and remove the table if no
+ * live rank is left registered in it.
+ */
+static void rendezvous_leave(int         fd,
+                             const char* path,
+                             int         num_ranks,
+                             int         rank)
+{
+    struct rendezvous_header header;
+    struct rendezvous_slot   slot;
+    off_t                    off;
+    int                      live = 0;
+    int                      i;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.num_ranks != num_ranks)
+        return;
+    for (i = 0; i < num_ranks; i++) {
+        off = sizeof(header) + i * sizeof(slot);
+        if (pread(fd, &slot, sizeof(slot), off) != sizeof(slot)) break;
+        if (!slot.registered) continue;
+        if (i == rank && slot.pid == getpid()) {
+            slot.registered = 0;
+            if (pwrite(fd, &slot, sizeof(slot), off) != sizeof(slot))
+                perror("pwrite");
+        } else if (proc_alive(slot.pid, slot.start_time))
+            live++;
+    }
+    if (!live) unlink(path);
+}
+
+/* With the rendezvous table locked, write our slot.  If the table is
+ * solved and our slot is already ours (we are resolving again), the
+ * assignment is reused as is.  Otherwise slots left by processes that are
+ * gone are cleared; if those processes had already solved the table (or it
+ * has the wrong layout, or a live process holds our slot), it belongs to an
+ * earlier job and is started afresh.
+ */
+static int rendezvous_register(int                           fd,
+                               int                           num_ranks,
+                               int                           rank,
+                               const struct rendezvous_slot* slot)
+{
+    struct rendezvous_header header;
+    struct rendezvous_slot   old;
+    off_t                    off;
+    int                      stale = 0;
+    int                      i;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.num_ranks != num_ranks)
+        stale = 1;
+    off = sizeof(header) + rank * sizeof(old);
+    if (!stale && header.solved
+        && pread(fd, &old, sizeof(old), off) == sizeof(old) && old.registered
+        && old.pid == slot->pid && old.start_time == slot->start_time)
+        return (0);
+    for (i = 0; i < num_ranks && !stale; i++) {
+        off = sizeof(header) + i * sizeof(old);
+        if (pread(fd, &old, sizeof(old), off) != sizeof(old)) {
+            stale = 1;
+            break;
+        }
+        if (!old.registered || old.pid == slot->pid) continue;
+        if (proc_alive(old.pid, old.start_time)) {
+            /* someone else is alive in our slot */
+            if (i == rank) stale = 1;
+            continue;
+        }
+        if (header.solved)
+            stale = 1;
+        else {
+            old.registered = 0;
+            if (pwrite(fd, &old, sizeof(old), off) != sizeof(old)) {
+                perror("pwrite");
+                return (-1);
+            }
+        }
+    }
+
+    if (stale) {
+        header.num_ranks = num_ranks;
+        header.solved    = 0;
+        header.claimed   = 0;
+        if (ftruncate(fd, 0) < 0
+            || ftruncate(fd, sizeof(header) + num_ranks * sizeof(old)) < 0
+            || pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            perror("ftruncate");
+            return (-1);
+        }
+    }
+
+    /* a solved table already has our assignment */
+    if (header.solved) return (0);
+
+    off = sizeof(header) + rank * sizeof(*slot);
+    if (pwrite(fd, slot, sizeof(*slot), off) != sizeof(*slot)) {
+        perror("pwrite");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/* With the rendezvous table locked: if every rank has registered, compute
+ * the assignment among the NICs in the selection's buckets, write it into
+ * the slots and mark the table solved.  Returns 0 if solved, 1 if still
+ * waiting for ranks.
+ */
+static int rendezvous_solve(int                     fd,
+                            int                     num_ranks,
+                            const struct selection* sel)
+{
+    struct rendezvous_header header = {0};
+    struct rendezvous_slot*  slots;
+    struct nic_table*        table;
+    struct nic_table         sub;
+    hwloc_cpuset_t*          sets;
+    int*                     assignment;
+    int                      ret;
+    int                      i;
+
+    slots = calloc(num_ranks, sizeof(*slots));
+    assert(slots);
+    ret = pread(fd, slots, num_ranks * sizeof(*slots), sizeof(header));
+    if (ret != (int)(num_ranks * sizeof(*slots))) {
+        free(slots);
+        return (1);
+    }
+    for (i = 0; i < num_ranks; i++) {
+        if (!slots[i].registered) {
+            free(slots);
+            return (1);
+        }
+    }
+
+    ret = get_nic_table(&table);
+    if (ret != 0 || table->num_nics < 1) {
+        free(slots);
+        return (-1);
+    }
+    /* e.g. only the NICs of the caller's service class */
+    bucket_nic_table(table, sel->nbuckets, sel->buckets, &sub);
+    if (sub.num_nics < 1) {
+        free(sub.nics);
+        free(sub.numa_cost);
+        free(slots);
+        return (-1);
+    }
+
+    sets       = calloc(num_ranks, sizeof(*sets));
+    assignment = malloc(num_ranks * sizeof(*assignment));
+    assert(sets && assignment);
+    for (i = 0; i < num_ranks; i++) {
+        sets[i] = hwloc_bitmap_alloc();
+        assert(sets[i]);
+        hwloc_bitmap_list_sscanf(sets[i], slots[i].cpuset);
+    }
+
+    ret = match_ranks(&sub, num_ranks, (hwloc_const_cpuset_t*)sets, 0,
+                      assignment);
+    if (ret == 0) {
+        for (i = 0; i < num_ranks; i++)
+            snprintf(slots[i].nic, sizeof(slots[i].nic), "%s",
+                     sub.nics[assignment[i]].name);
+        header.num_ranks = num_ranks;
+        header.solved    = 1;
+        if (pwrite(fd, slots, num_ranks * sizeof(*slots), sizeof(header)) < 0
+            || pwrite(fd, &header, sizeof(header), 0) < 0) {
+            perror("pwrite");
+            ret = -1;
+        }
+    }
+
+    for (i = 0; i < num_ranks; i++) hwloc_bitmap_free(sets[i]);
+    free(sets);
+    free(assignment);
+    free(slots);
+    free(sub.nics);
+    free(sub.numa_cost);
+
+    return (ret);
+}
+
+/* The part of table made up of the NICs in the buckets, sharing its
+ * topology and NIC entries; sub->nics and sub->numa_cost are to be freed
+ * by the caller.
+ */
+static void bucket_nic_table(struct nic_table* table,
+                             int               nbuckets,
+                             struct bucket*    buckets,
+                             struct nic_table* sub)
+{
+    int numa;
+    int i;
+    int n = 0;
+
+    *sub           = *table;
+    sub->nics      = calloc(table->num_nics, sizeof(*sub->nics));
+    sub->numa_cost = calloc(table->num_numa * table->num_nics,
+                            sizeof(*sub->numa_cost));
+    assert(sub->nics && sub->numa_cost);
+
+    for (i = 0; i < table->num_nics; i++) {
+        if (!in_buckets(nbuckets, buckets, table->nics[i].name)) continue;
+        sub->nics[n] = table->nics[i];
+        n++;
+    }
+    sub->num_nics = n;
+
+    for (numa = 0; numa < table->num_numa; numa++) {
+        for (i = 0; i < n; i++)
+            sub->numa_cost[numa * n + i]
+                = table->numa_cost[numa * table->num_nics
+                                   + find_nic(table, sub->nics[i].name)];
+    }
+}
+
+/* Find this process's rank among (and the number of) processes on this
+ * node, from the registered callback or launcher environment variables.
+ * local_size is set to -1 if it is not known.
+ */
+static int get_local_rank(int* local_rank, int* local_size)
+{
+    const char* rank_str;
+    const char* size_str;
+    int         size;
+    int         i;
+
+    *local_size = -1;
+
+    if (g_local_rank_fn)
+        return (g_local_rank_fn(local_rank, local_size, g_local_rank_arg));
+
+    for (i = 0; g_local_rank_envs[i].rank; i++) {
+        rank_str = getenv(g_local_rank_envs[i].rank);
+        if (!rank_str) continue;
+        *local_rank = atoi(rank_str);
+        size_str    = getenv(g_local_rank_envs[i].size);
+        if (!size_str)
+            size = -1;
+        else if (strcmp(g_local_rank_envs[i].size, "SLURM_TASKS_PER_NODE") == 0)
+            size = slurm_local_size(size_str);
+        else
+            size = atoi(size_str);
+        if (size > *local_rank) *local_size = size;
+        return (*local_rank >= 0 ? 0 : -1);
+    }
+
+    return (-1);
+}
+
+/* Slurm gives the number of tasks on each node of the step in a compressed
+ * form, e.g. "4(x2),3" for 4 tasks on each of the first two nodes and 3 on
+ * the third; return the count for this node (SLURM_NODEID), or -1 if it
+ * can't be told.
+ */
+static int slurm_local_size(const char* tasks_per_node)
+{
+    const char* node_str = getenv("SLURM_NODEID");
+    const char* p        = tasks_per_node;
+    char*       end;
+    long        count;
+    long        repeat;
+    long        node_id;
+
+    /* without a node id, only a uniform count is of any use */
+    node_id = node_str ? atol(node_str) : 0;
+    if (node_id < 0) return (-1);
+
+    while (*p) {
+        count = strtol(p, &end, 10);
+        if (end == p) return (-1);
+        repeat = 1;
+        if (strncmp(end, "(x", 2) == 0) {
+            repeat = strtol(end + 2, &end, 10);
+            if (*end != ')') return (-1);
+            end++;
+        }
+        if (*end != ',' && *end != '\0') return (-1);
+        if (node_id < repeat) {
+            if (!node_str && *end != '\0') return (-1);
+            return ((int)count);
+        }
+        node_id -= repeat;
+        p = *end ? end + 1 : end;
+    }
+
+    return (-1);
+}
+
+/* static mapping based on what specific core the process is presently
+ * runnign on.
+ */
+static int select_nic_bycore(const struct selection* sel,
+                             const char**            out_nic)
+{
+    struct bucket* bucket  = &sel->buckets[sel->bucket_idx];
+    int            nic_idx = -1;
+    int            ret;
+    hwloc_cpuset_t last_cpu;
+
+    /* an explicit target stands in for the core we would be running on */
+    if (sel->target) {
+        nic_idx  = location_first_index(sel->target) % bucket->num_nics;
+        *out_nic = bucket->nics[nic_idx];
+        return (0);
+    }
+
+    last_cpu = hwloc_bitmap_alloc();
+    assert(last_cpu);
+
+    ret = hwloc_get_last_cpu_location(*sel->topology, last_cpu,
+                                      HWLOC_CPUBIND_THREAD);
+    if (ret < 0) {
+        hwloc_bitmap_free(last_cpu);
+        fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
+        return (-1);
+    }
+    nic_idx = hwloc_bitmap_first(last_cpu) % bucket->num_nics;
+    hwloc_bitmap_free(last_cpu);
+
+    *out_nic = bucket->nics[nic_idx];
+    return (0);
+}
+
+/* static mapping based on the set of cores the process is allowed to run on */
+static int select_nic_byset(const struct selection* sel, const char** out_nic)
+{
+    struct bucket* bucket  = &sel->buckets[sel->bucket_idx];
     int            nic_idx = -1;
     int            ret;
+    hwloc_cpuset_t cpuset;
+
+    /* an explicit target stands in for the set we would be bound to */
+    if (sel->target) {
+        nic_idx  = location_first_index(sel->target) % bucket->num_nics;
+        *out_nic = bucket->nics[nic_idx];
+        return (0);
+    }
+
+    cpuset = hwloc_bitmap_alloc();
+    assert(cpuset);
+
+    ret = hwloc_get_cpubind(*sel->topology, cpuset, HWLOC_CPUBIND_PROCESS);
+    if (ret < 0) {
+        hwloc_bitmap_free(cpuset);
+        fprintf(stderr, "hwloc_get_cpuset_location() failure.\n");
+        return (-1);
+    }
+    nic_idx = hwloc_bitmap_first(cpuset) % bucket->num_nics;
+    hwloc_bitmap_free(cpuset);
+
+    *out_nic = bucket->nics[nic_idx];
+    return (0);
+}
+
+/* Bind the calling thread (or process) to the cores local to a NIC, within
+ * whatever it is currently allowed to run on, and optionally its memory to
+ * the NIC's NUMA node(s).
+ */
+static int bind_to_nic(hwloc_topology_t* topology, const char* nic, int flags)
+{
+    struct nic_table* table;
+    hwloc_obj_t       locality;
+    hwloc_cpuset_t    cpuset;
+    int               cpubind_flags = HWLOC_CPUBIND_THREAD;
+    int               membind_flags = HWLOC_MEMBIND_THREAD;
+    int               nic_idx;
+    int               ret;
+
+    ret = get_nic_table(&table);
+    if (ret != 0) return (-1);
+    nic_idx = find_nic(table, nic);
+    if (nic_idx < 0) return (-1);
+    locality = table->nics[nic_idx].locality;
+
+    if (flags & MOCHI_PLUMBER_BIND_PROCESS) {
+        cpubind_flags = HWLOC_CPUBIND_PROCESS;
+        membind_flags = HWLOC_MEMBIND_PROCESS;
+    }
+
+    if (flags & (MOCHI_PLUMBER_BIND_THREAD | MOCHI_PLUMBER_BIND_PROCESS)) {
+        cpuset = hwloc_bitmap_alloc();
+        assert(cpuset);
+        ret = hwloc_get_cpubind(*topology, cpuset, cpubind_flags);
+        if (ret < 0)
+            hwloc_bitmap_copy(cpuset,
+                              hwloc_topology_get_allowed_cpuset(*topology));
+        hwloc_bitmap_and(cpuset, cpuset, locality->cpuset);
+
+        if (hwloc_bitmap_iszero(cpuset)) {
+            /* none of the NIC's cores are available to us; leave the
+             * existing binding alone rather than escape it
+             */
+            fprintf(stderr,
+                    "Warning: no cores local to %s in current binding; not "
+                    "binding.\n",
+                    nic);
+        } else {
+            ret = hwloc_set_cpubind(*topology, cpuset, cpubind_flags);
+            if (ret < 0) {
+                perror("hwloc_set_cpubind");
+                hwloc_bitmap_free(cpuset);
+                return (-1);
+            }
+        }
+        hwloc_bitmap_free(cpuset);
+    }
+
+    if (flags & MOCHI_PLUMBER_BIND_MEMORY) {
+        ret = hwloc_set_membind(*topology, locality->nodeset,
+                                HWLOC_MEMBIND_BIND,
+                                membind_flags | HWLOC_MEMBIND_BYNODESET);
+        if (ret < 0) {
+            perror("hwloc_set_membind");
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+/* index used by the static bycore/byset mappings for an explicit target:
+ * its first PU, or its first NUMA node if it has no PUs
+ */
+static int location_first_index(const struct location* target)
+{
+    if (!hwloc_bitmap_iszero(target->cpuset))
+        return (hwloc_bitmap_first(target->cpuset));
+    return (hwloc_bitmap_first(target->nodeset));
+}
+
+/* Parse a location string into a cpuset/nodeset pair.  Accepts an hwloc
+ * bitmap string ("0x0000ffff") or list ("32-47"), optionally prefixed with
+ * "cpuset:" or "nodeset:" to say what the indices refer to (cpuset is the
+ * default).  The result is trimmed to what exists in the topology.
+ */
+static int parse_location(hwloc_topology_t* topology,
+                          const char*       location_string,
+                          struct location*  target)
+{
+    const char*    spec       = location_string;
+    int            is_nodeset = 0;
+    hwloc_bitmap_t bitmap;
+    int            ret;
+
+    if (strncmp(spec, "cpuset:", strlen("cpuset:")) == 0)
+        spec += strlen("cpuset:");
+    else if (strncmp(spec, "nodeset:", strlen("nodeset:")) == 0) {
+        spec += strlen("nodeset:");
+        is_nodeset = 1;
+    }
+
+    bitmap = hwloc_bitmap_alloc();
+    assert(bitmap);
+    if (strncmp(spec, "0x", strlen("0x")) == 0)
+        ret = hwloc_bitmap_sscanf(bitmap, spec);
+    else
+        ret = hwloc_bitmap_list_sscanf(bitmap, spec);
+    if (ret < 0) {
+        hwloc_bitmap_free(bitmap);
+        return (-1);
+    }
+
+    target->cpuset  = hwloc_bitmap_alloc();
+    target->nodeset = hwloc_bitmap_alloc();
+    assert(target->cpuset && target->nodeset);
+    if (is_nodeset) {
+        hwloc_bitmap_and(target->nodeset, bitmap,
+                         hwloc_topology_get_complete_nodeset(*topology));
+        hwloc_cpuset_from_nodeset(*topology, target->cpuset, target->nodeset);
+    } else {
+        hwloc_bitmap_and(target->cpuset, bitmap,
+                         hwloc_topology_get_complete_cpuset(*topology));
+        hwloc_cpuset_to_nodeset(*topology, target->cpuset, target->nodeset);
+    }
+    hwloc_bitmap_free(bitmap);
+
+    if (hwloc_bitmap_iszero(target->nodeset)) {
+        /* nothing in the topology matched */
+        release_location(target);
+        return (-1);
+    }
+
+    return (0);
+}
+
+static void release_location(struct location* target)
+{
+    if (!target) return;
+
+    if (target->cpuset) hwloc_bitmap_free(target->cpuset);
+    if (target->nodeset) hwloc_bitmap_free(target->nodeset);
+    target->cpuset  = NULL;
+    target->nodeset = NULL;
+
+    return;
+}
+
+static int count_packages(hwloc_topology_t* topology)
+{
+    hwloc_obj_t obj = NULL;
+    hwloc_obj_t root;
+    int         package_count = 0;
+
+    root = hwloc_get_root_obj(*topology);
+    do {
+        obj = hwloc_get_next_child(*topology, root, obj);
+        if (obj && obj->type == HWLOC_OBJ_PACKAGE) { package_count++; }
+    } while (obj);
+
+    return (package_count);
+}
+
+/* query libfabric for the PCI-attached NICs and find each of them in the
+ * hwloc topology
+ */
+static int discover_nics(hwloc_topology_t*  topology,
+                         int*               num_nics,
+                         struct nic_entry** nics)
+{
+    struct fi_info* info;
+    struct fi_info* hints;
+    struct fi_info* cur;
+    int             ret;
+    hwloc_obj_t     pci_dev;
+
+    *num_nics = 0;
+    *nics     = NULL;
+
+    /* query libfabric for interfaces */
+    hints = fi_allocinfo();
+    assert(hints);
+    /* These are required as input if we want to filter the results; they
+     * indicate functionality that the caller is prepared to provide.  This
+     * is just a query, so we want wildcard options except that we must disable
+     * deprecated memory registration modes.
+     */
+    hints->mode                 = ~0;
+    hints->domain_attr->mode    = ~0;
+    hints->domain_attr->mr_mode = ~3;
+    /* only supporting cxi for now */
+    hints->fabric_attr->prov_name = strdup("cxi");
+    hints->ep_attr->protocol      = FI_PROTO_CXI;
+    ret = fi_getinfo(FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION), NULL, NULL,
+                     0, hints, &info);
+    if (ret != 0) {
+        fprintf(stderr, "fi_getinfo: %d (%s)\n", ret, fi_strerror(-ret));
+        fi_freeinfo(hints);
+        return (ret);
+    }
+    fi_freeinfo(hints);
+
+    for (cur = info; cur; cur = cur->next) {
+        if (cur->nic && cur->nic->bus_attr
+            && cur->nic->bus_attr->bus_type == FI_BUS_PCI) {
+
+            /* look for this device in hwloc topology */
+            struct fi_pci_attr pci = cur->nic->bus_attr->attr.pci;
+            pci_dev = hwloc_get_pcidev_by_busid(*topology, pci.domain_id,
+                                                pci.bus_id, pci.device_id,
+                                                pci.function_id);
+            if (!pci_dev) {
+                fprintf(stderr, "Error: can't find %s in hwloc topology.\n",
+                        cur->domain_attr->name);
+                fi_freeinfo(info);
+                release_nics(*num_nics, *nics);
+                *num_nics = 0;
+                *nics     = NULL;
+                return (-1);
+            }
+
+            (*num_nics)++;
+            *nics = realloc(*nics, *num_nics * sizeof(**nics));
+            assert(*nics);
+            (*nics)[*num_nics - 1].name = strdup(cur->domain_attr->name);
+            assert((*nics)[*num_nics - 1].name);
+            (*nics)[*num_nics - 1].pci_dev = pci_dev;
+            (*nics)[*num_nics - 1].locality
+                = hwloc_get_non_io_ancestor_obj(*topology, pci_dev);
+            (*nics)[*num_nics - 1].max_eps = cur->domain_attr->ep_cnt;
+            if (cur->domain_attr->tx_ctx_cnt
+                && cur->domain_attr->tx_ctx_cnt < cur->domain_attr->ep_cnt)
+                (*nics)[*num_nics - 1].max_eps = cur->domain_attr->tx_ctx_cnt;
+            /* kept in the table (so that buckets don't shift), but not
+             * handed back by MOCHI_PLUMBER_STICKY
+             */
+            (*nics)[*num_nics - 1].link_down
+                = cur->nic->link_attr
+                  && cur->nic->link_attr->state == FI_LINK_DOWN;
+        }
+    }
+    fi_freeinfo(info);
+
+    return (0);
+}
+
+static void release_nics(int num_nics, struct nic_entry* nics)
+{
+    int i;
+
+    for (i = 0; i < num_nics; i++) free(nics[i].name);
+    free(nics);
+
+    return;
+}
+
+/* Find a NIC in the table by name.  Accepts either a bare NIC name (cxi0)
+ * or an address naming one (cxi://cxi0, ofi+cxi://cxi0:1234).  Returns -1
+ * if it is not found.
+ */
+static int find_nic(struct nic_table* table, const char* nic)
+{
+    const char* name = nic;
+    const char* found;
+    size_t      len;
+    int         i;
+
+    found = strstr(nic, "://");
+    if (found) name = found + strlen("://");
+    len = strcspn(name, ":/?");
+
+    for (i = 0; i < table->num_nics; i++) {
+        if (strlen(table->nics[i].name) == len
+            && strncmp(table->nics[i].name, name, len) == 0)
+            return (i);
+    }
+
+    return (-1);
+}
+
+/* build (once) and return the process-wide NIC table */
+static int get_nic_table(struct nic_table** table)
+{
+    struct nic_table*         t;
+    struct hwloc_distances_s* distances = NULL;
+    unsigned                  nr        = 1;
+    int                       ret;
+    int                       i;
+    int                       j;
+
+    pthread_mutex_lock(&g_nic_table_mutex);
+    if (g_nic_table) {
+        *table = g_nic_table;
+        pthread_mutex_unlock(&g_nic_table_mutex);
+        return (0);
+    }
+
+    t = calloc(1, sizeof(*t));
+    if (!t) {
+        pthread_mutex_unlock(&g_nic_table_mutex);
+        return (-1);
+    }
+
+    hwloc_topology_init(&t->topology);
+    hwloc_topology_set_io_types_filter(t->topology,
+                                       HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
+    hwloc_topology_load(t->topology);
+
+    ret = discover_nics(&t->topology, &t->num_nics, &t->nics);
+    if (ret != 0) {
+        hwloc_topology_destroy(t->topology);
+        free(t);
+        pthread_mutex_unlock(&g_nic_table_mutex);
+        return (ret);
+    }
+    drop_excluded_nics(&t->num_nics, t->nics);
+
+    /* precompute the distance from every NUMA node to every NIC so that
+     * locality queries are just a table lookup
+     */
+    t->num_numa
+        = hwloc_bitmap_last(hwloc_topology_get_complete_nodeset(t->topology))
+        + 1;
+    t->numa_cost = calloc(t->num_numa * t->num_nics + 1, sizeof(int));
+    assert(t->numa_cost);
+    ret = hwloc_distances_get_by_type(t->topology, HWLOC_OBJ_NUMANODE, &nr,
+                                      &distances,
+                                      HWLOC_DISTANCES_KIND_MEANS_LATENCY, 0);
+    if (ret < 0 || nr < 1) distances = NULL;
+    for (i = 0; i < t->num_numa; i++) {
+        for (j = 0; j < t->num_nics; j++)
+            t->numa_cost[i * t->num_nics + j]
+                = numa_nic_cost(t->topology, distances, i, &t->nics[j]);
+    }
+    if (distances) hwloc_distances_release(t->topology, distances);
+
+    g_nic_table = t;
+    *table      = t;
+    pthread_mutex_unlock(&g_nic_table_mutex);
+
+    return (0);
+}
+
+/* Distance from a NUMA node to a NIC, in the units of the ACPI SLIT (10 is
+ * local).  Uses the OS-provided NUMA latency matrix if there is one,
+ * otherwise a coarse same-package/remote-package estimate.
+ */
+static int numa_nic_cost(hwloc_topology_t          topology,
+                         struct hwloc_distances_s* distances,
+                         int                       numa,
+                         const struct nic_entry*   nic)
+{
+    hwloc_obj_t    node;
+    hwloc_obj_t    nic_node;
+    hwloc_obj_t    package;
+    hwloc_obj_t    nic_package;
+    hwloc_uint64_t remote;
+    hwloc_uint64_t local;
+    int            ret;
+
+    if (hwloc_bitmap_isset(nic->locality->nodeset, numa)) return (10);
+
+    node = hwloc_get_numanode_obj_by_os_index(topology, numa);
+    if (!node) return (INT16_MAX);
+    nic_node = hwloc_get_numanode_obj_by_os_index(
+        topology, hwloc_bitmap_first(nic->locality->nodeset));
+
+    if (distances && nic_node) {
+        ret = hwloc_distances_obj_pair_values(distances, node, nic_node,
+                                              &remote, NULL);
+        if (ret == 0)
+            ret = hwloc_distances_obj_pair_values(distances, node, node,
+                                                  &local, NULL);
+        if (ret == 0 && local > 0) return ((int)(remote * 10 / local));
+    }
+
+    package     = hwloc_get_ancestor_obj_by_type(topology, HWLOC_OBJ_PACKAGE,
+                                                 node);
+    nic_package = hwloc_get_ancestor_obj_by_type(topology, HWLOC_OBJ_PACKAGE,
+                                                 nic->pci_dev);
+    if (package && package == nic_package) return (20);
+
+    return (30);
+}
+
+/* distance from the closest NUMA node in a nodeset to a NIC */
+static int nodeset_nic_cost(struct nic_table*     table,
+                            hwloc_const_nodeset_t nodeset,
+                            int                   nic_idx)
+{
+    int numa;
+    int cost = INT16_MAX;
+
+    hwloc_bitmap_foreach_begin(numa, nodeset)
+    {
+        if (numa >= table->num_numa) break;
+        if (table->numa_cost[numa * table->num_nics + nic_idx] < cost)
+            cost = table->numa_cost[numa * table->num_nics + nic_idx];
+    }
+    hwloc_bitmap_foreach_end();
+
+    return (cost);
+}
+
+/* Distance from a rank's cores to a NIC: the NUMA distance, less a little
+ * if the cores are all within the NIC's own locality (e.g. the same L3 or
+ * die)
+ */
+static int cpuset_nic_cost(struct nic_table*    table,
+                           hwloc_const_cpuset_t cpuset,
+                           int                  nic_idx)
+{
+    hwloc_nodeset_t nodeset;
+    int             cost;
+
+    nodeset = hwloc_bitmap_alloc();
+    assert(nodeset);
+    hwloc_cpuset_to_nodeset(table->topology, cpuset, nodeset);
+    cost = 2 * nodeset_nic_cost(table, nodeset, nic_idx);
+    hwloc_bitmap_free(nodeset);
+
+    if (hwloc_bitmap_isincluded(cpuset,
+                                table->nics[nic_idx].locality->cpuset))
+        cost--;
+
+    return (cost);
+}
+
+/* Assign ranks to NICs at minimum total distance, with at most capacity
+ * ranks per NIC (0 for an even split).  This is a min-cost flow solved by
+ * successive shortest paths: ranks are added one at a time, and each may
+ * displace already-assigned ranks along a chain of NICs if that lowers the
+ * total.  The NICs are the only intermediate nodes, so each step is a
+ * Bellman-Ford over a num_nics-node graph; 256 ranks on 16 NICs takes a
+ * few milliseconds.
+ */
+static int match_ranks(struct nic_table*     table,
+                       int                   num_ranks,
+                       hwloc_const_cpuset_t* cpusets,
+                       int                   capacity,
+                       int*                  assignment)
+{
+    int  n = table->num_nics;
+    int* cost;
+    int* load;
+    int* weight;
+    int* via;
+    int* dist;
+    int* pred;
+    int  changed;
+    int  r;
+    int  s;
+    int  a;
+    int  b;
+    int  d;
+    int  t;
+    int  i;
+
+    if (capacity < 1) capacity = (num_ranks + n - 1) / n;
+    if ((long)capacity * n < num_ranks) {
+        fprintf(stderr, "Error: %d ranks do not fit on %d NICs of %d.\n",
+                num_ranks, n, capacity);
+        return (-1);
+    }
+
+    cost   = malloc(num_ranks * n * sizeof(*cost));
+    load   = calloc(n, sizeof(*load));
+    weight = malloc(n * n * sizeof(*weight));
+    via    = malloc(n * n * sizeof(*via));
+    dist   = malloc(n * sizeof(*dist));
+    pred   = malloc(n * sizeof(*pred));
+    assert(cost && load && weight && via && dist && pred);
+
+    for (r = 0; r < num_ranks; r++) {
+        for (b = 0; b < n; b++)
+            cost[r * n + b] = cpuset_nic_cost(table, cpusets[r], b);
+    }
+
+    for (s = 0; s < num_ranks; s++) {
+        /* cheapest way to move one already-assigned rank from a to b */
+        for (i = 0; i < n * n; i++) {
+            weight[i] = INT_MAX;
+            via[i]    = -1;
+        }
+        for (r = 0; r < s; r++) {
+            a = assignment[r];
+            for (b = 0; b < n; b++) {
+                d = cost[r * n + b] - cost[r * n + a];
+                if (b != a && d < weight[a * n + b]) {
+                    weight[a * n + b] = d;
+                    via[a * n + b]    = r;
+                }
+            }
+        }
+
+        /* shortest paths from the new rank to every NIC */
+        for (b = 0; b < n; b++) {
+            dist[b] = cost[s * n + b];
+            pred[b] = -1;
+        }
+        for (i = 0, changed = 1; i < n && changed; i++) {
+            changed = 0;
+            for (a = 0; a < n; a++) {
+                for (b = 0; b < n; b++) {
+                    if (weight[a * n + b] != INT_MAX
+                        && dist[a] + weight[a * n + b] < dist[b]) {
+                        dist[b] = dist[a] + weight[a * n + b];
+                        pred[b] = a;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+
+        /* end at the closest NIC with room, and shift ranks along the way */
+        t = -1;
+        for (b = 0; b < n; b++) {
+            if (load[b] < capacity && (t < 0 || dist[b] < dist[t])) t = b;
+        }
+        load[t]++;
+        for (b = t; pred[b] >= 0; b = pred[b])
+            assignment[via[pred[b] * n + b]] = b;
+        assignment[s] = b;
+    }
+
+    free(cost);
+    free(load);
+    free(weight);
+    free(via);
+    free(dist);
+    free(pred);
+
+    return (0);
+}
+
+/* find out which NUMA node(s) the memory backing a buffer lives on */
+static int buffer_nodeset(struct nic_table* table,
+                          const void*       addr,
+                          size_t            len,
+                          hwloc_nodeset_t   nodeset)
+{
     hwloc_cpuset_t last_cpu;
+    int            ret;
 
+    ret = hwloc_get_area_memlocation(table->topology, addr, len, nodeset,
+                                     HWLOC_MEMBIND_BYNODESET);
+    if (ret == 0 && !hwloc_bitmap_iszero(nodeset)) return (0);
+
+    /* the pages have not been touched yet (or the OS can't tell us where
+     * they are); assume they will be first-touched where we are running
+     */
     last_cpu = hwloc_bitmap_alloc();
     assert(last_cpu);
-
-    ret = hwloc_get_last_cpu_location(*topology, last_cpu,
+    ret = hwloc_get_last_cpu_location(table->topology, last_cpu,
                                       HWLOC_CPUBIND_THREAD);
     if (ret < 0) {
         hwloc_bitmap_free(last_cpu);
         fprintf(stderr, "hwloc_get_last_cpu_location() failure.\n");
         return (-1);
     }
-    nic_idx = hwloc_bitmap_first(last_cpu) % bucket->num_nics;
+    hwloc_cpuset_to_nodeset(table->topology, last_cpu, nodeset);
     hwloc_bitmap_free(last_cpu);
 
-    *out_nic = bucket->nics[nic_idx];
     return (0);
 }
 
-/* static mapping based on the set of cores the process is allowed to run on */
-static int select_nic_byset(hwloc_topology_t* topology,
-                            int               bucket_idx,
-                            struct bucket*    bucket,
-                            const char**      out_nic)
+/* Pick the candidate NIC closest to a buffer.  Candidates are indices into
+ * the NIC table (all of them if candidates is NULL); -1 entries are NICs
+ * with unknown locality.  Ties are broken by the buffer address so that
+ * different buffers spread over equally close NICs while any one buffer
+ * always maps to the same NIC.
+ */
+static int closest_nic(struct nic_table* table,
+                       const void*       addr,
+                       size_t            len,
+                       int               num_candidates,
+                       const int*        candidates,
+                       int*              out_idx)
 {
-    int            nic_idx = -1;
-    int            ret;
-    hwloc_cpuset_t cpuset;
-
-    cpuset = hwloc_bitmap_alloc();
-    assert(cpuset);
+    hwloc_nodeset_t nodeset;
+    int*            costs;
+    int             best_cost = INT_MAX;
+    int             nties     = 0;
+    int             tie;
+    int             nic_idx;
+    int             ret;
+    int             i;
 
-    ret = hwloc_get_cpubind(*topology, cpuset, HWLOC_CPUBIND_PROCESS);
+    nodeset = hwloc_bitmap_alloc();
+    assert(nodeset);
+    ret = buffer_nodeset(table, addr, len, nodeset);
     if (ret < 0) {
-        hwloc_bitmap_free(cpuset);
-        fprintf(stderr, "hwloc_get_cpuset_location() failure.\n");
+        hwloc_bitmap_free(nodeset);
         return (-1);
     }
-    nic_idx = hwloc_bitmap_first(cpuset) % bucket->num_nics;
-    hwloc_bitmap_free(cpuset);
 
-    *out_nic = bucket->nics[nic_idx];
+    costs = malloc(num_candidates * sizeof(*costs));
+    if (!costs) {
+        hwloc_bitmap_free(nodeset);
+        return (-1);
+    }
+    for (i = 0; i < num_candidates; i++) {
+        nic_idx  = candidates ? candidates[i] : i;
+        costs[i] = nic_idx < 0 ? INT16_MAX + 1
+                               : nodeset_nic_cost(table, nodeset, nic_idx);
+        if (costs[i] < best_cost) {
+            best_cost = costs[i];
+            nties     = 0;
+        }
+        if (costs[i] == best_cost) nties++;
+    }
+    hwloc_bitmap_free(nodeset);
+
+    tie = (int)(((uintptr_t)addr >> 21) % nties);
+    for (i = 0; i < num_candidates; i++) {
+        if (costs[i] == best_cost && tie-- == 0) break;
+    }
+    free(costs);
+
+    *out_idx = i;
     return (0);
 }
 
-static int count_packages(hwloc_topology_t* topology)
+/* Divide up the node's NICs (those of the service class's partition, if
+ * one is given) into buckets according to a bucket policy, resolving
+ * "auto" to the policy it settles on.
+ */
+static int setup_buckets(struct nic_table*   table,
+                         enum bucket_policy* bucket_policy,
+                         const char*         service_class,
+                         int*                nbuckets,
+                         struct bucket**     buckets)
 {
-    hwloc_obj_t obj = NULL;
-    hwloc_obj_t root;
-    int         package_count = 0;
-
-    root = hwloc_get_root_obj(*topology);
-    do {
-        obj = hwloc_get_next_child(*topology, root, obj);
-        if (obj && obj->type == HWLOC_OBJ_PACKAGE) { package_count++; }
-    } while (obj);
+    hwloc_topology_t* topology = &table->topology;
+    struct nic_entry* nics     = table->nics;
+    int               ret;
+    char*             partition  = NULL;
+    int               bucket_idx = 0;
+    int               i;
 
-    return (package_count);
-}
+    /* a service class only gets the NICs in its partition */
+    if (service_class) {
+        ret = find_partition(service_class, &partition);
+        if (ret < 0) return (-1);
+    }
 
-static int setup_buckets(hwloc_topology_t* topology,
-                         const char*       bucket_policy,
-                         int*              nbuckets,
-                         struct bucket**   buckets)
-{
-    hwloc_const_bitmap_t nset_all;
-    struct fi_info*      info;
-    struct fi_info*      hints;
-    struct fi_info*      cur;
-    int                  ret;
-    hwloc_obj_t          pci_dev;
-    int                  bucket_idx = 0;
-    hwloc_obj_t          non_io_ancestor;
-    hwloc_obj_t          package_ancestor;
-    int                  i;
+    if (*bucket_policy == BUCKET_AUTO)
+        *bucket_policy = auto_bucket_policy(topology, table->num_nics, nics,
+                                            partition);
 
     /* figure out how many buckets there will be */
-    if (strcmp(bucket_policy, "all") == 0) {
-        /* just one big bucket */
-        *nbuckets = 1;
-    } else if (strcmp(bucket_policy, "numa") == 0) {
-        /* we need to query number of numa domains and make a bucket for
-         * each
-         */
-        nset_all  = hwloc_topology_get_complete_nodeset(*topology);
-        *nbuckets = hwloc_bitmap_weight(nset_all);
-    } else if (strcmp(bucket_policy, "package") == 0) {
-        /* query number of packages and make a bucket for each */
-        *nbuckets = count_packages(topology);
-    } else {
-        fprintf(stderr,
-                "mochi_plumber_resolve_nic: unknown bucket policy \"%s\"\n",
-                bucket_policy);
+    *nbuckets = count_buckets(topology, *bucket_policy);
+    *buckets  = calloc(*nbuckets, sizeof(**buckets));
+    if (!*buckets) {
+        free(partition);
         return (-1);
     }
 
-    *buckets = calloc(*nbuckets, sizeof(**buckets));
-    if (!*buckets) { return (-1); }
+    /* iterate through interfaces and assign to buckets */
+    for (i = 0; i < table->num_nics; i++) {
+        if (partition && !in_list(partition, nics[i].name)) continue;
 
-    /* query libfabric for interfaces */
-    hints = fi_allocinfo();
-    assert(hints);
-    /* These are required as input if we want to filter the results; they
-     * indicate functionality that the caller is prepared to provide.  This
-     * is just a query, so we want wildcard options except that we must disable
-     * deprecated memory registration modes.
-     */
-    hints->mode                 = ~0;
-    hints->domain_attr->mode    = ~0;
-    hints->domain_attr->mr_mode = ~3;
-    /* only supporting cxi for now */
-    hints->fabric_attr->prov_name = strdup("cxi");
-    hints->ep_attr->protocol      = FI_PROTO_CXI;
-    ret = fi_getinfo(FI_VERSION(FI_MAJOR_VERSION, FI_MINOR_VERSION), NULL, NULL,
-                     0, hints, &info);
-    if (ret != 0) {
-        fprintf(stderr, "fi_getinfo: %d (%s)\n", ret, fi_strerror(-ret));
-        fi_freeinfo(hints);
-        free(*buckets);
-        return (ret);
+        if (*nbuckets == 1)
+            /* add to the global bucket */
+            bucket_idx = 0;
+        else
+            bucket_idx = nic_bucket(topology, *bucket_policy, &nics[i]);
+
+        (*buckets)[bucket_idx].num_nics++;
+        (*buckets)[bucket_idx].nics
+            = realloc((*buckets)[bucket_idx].nics,
+                      (*buckets)[bucket_idx].num_nics
+                          * sizeof(*(*buckets)[bucket_idx].nics));
+        assert((*buckets)[bucket_idx].nics);
+        (*buckets)[bucket_idx].nics[(*buckets)[bucket_idx].num_nics - 1]
+            = strdup(nics[i].name);
+        assert((*buckets)[bucket_idx]
+                   .nics[(*buckets)[bucket_idx].num_nics - 1]);
     }
-    fi_freeinfo(hints);
+    free(partition);
 
-    /* iterate through interfaces and assign to buckets */
-    for (cur = info; cur; cur = cur->next) {
-        if (cur->nic && cur->nic->bus_attr
-            && cur->nic->bus_attr->bus_type == FI_BUS_PCI) {
+    if (*bucket_policy == BUCKET_NUMA && *nbuckets > 1)
+        fill_cpuless_buckets(topology, *nbuckets, *buckets);
 
-            /* look for this device in hwloc topology */
-            struct fi_pci_attr pci = cur->nic->bus_attr->attr.pci;
-            pci_dev = hwloc_get_pcidev_by_busid(*topology, pci.domain_id,
-                                                pci.bus_id, pci.device_id,
-                                                pci.function_id);
-            if (!pci_dev) {
-                fprintf(stderr, "Error: can't find %s in hwloc topology.\n",
-                        cur->domain_attr->name);
-                fi_freeinfo(info);
-                for (i = 0; i < *nbuckets; i++) {
-                    if ((*buckets)[i].nics) free((*buckets)[i].nics);
-                }
-                free(*buckets);
-                return (-1);
-            }
-            if (*nbuckets == 1) {
-                /* add to the global bucket */
-                bucket_idx = 0;
-            } else if (strcmp(bucket_policy, "numa") == 0) {
-                /* figure out what numa domain this maps to and put it in
-                 * that bucket
-                 */
-                non_io_ancestor
-                    = hwloc_get_non_io_ancestor_obj(*topology, pci_dev);
-                bucket_idx = hwloc_bitmap_first(non_io_ancestor->nodeset);
-            } else if (strcmp(bucket_policy, "package") == 0) {
-                /* figure out what package this maps to and put it in that
-                 * bucket
-                 */
-                package_ancestor = hwloc_get_ancestor_obj_by_type(
-                    *topology, HWLOC_OBJ_PACKAGE, pci_dev);
-                bucket_idx = package_ancestor->os_index;
+    return (0);
+}
+
+static int count_buckets(hwloc_topology_t*  topology,
+                         enum bucket_policy bucket_policy)
+{
+    switch (bucket_policy) {
+    case BUCKET_NUMA:
+        /* a bucket for each numa domain */
+        return (hwloc_bitmap_weight(
+            hwloc_topology_get_complete_nodeset(*topology)));
+    case BUCKET_PACKAGE:
+        /* a bucket for each package */
+        return (count_packages(topology));
+    default:
+        /* just one big bucket */
+        return (1);
+    }
+}
+
+/* the bucket that a NIC belongs in when there is more than one */
+static int nic_bucket(hwloc_topology_t*       topology,
+                      enum bucket_policy      bucket_policy,
+                      const struct nic_entry* nic)
+{
+    hwloc_obj_t package_ancestor;
+
+    if (bucket_policy == BUCKET_NUMA) {
+        /* figure out what numa domain this maps to */
+        return (hwloc_bitmap_first(nic->locality->nodeset));
+    } else if (bucket_policy == BUCKET_PACKAGE) {
+        /* figure out what package this maps to */
+        package_ancestor = hwloc_get_ancestor_obj_by_type(
+            *topology, HWLOC_OBJ_PACKAGE, nic->pci_dev);
+        return (package_ancestor->os_index);
+    }
+
+    return (0);
+}
+
+/* Does splitting the NICs by this policy give every bucket that processes
+ * can run in the same, nonzero, number of NICs?  CPU-less NUMA nodes (e.g.
+ * HBM or GPU memory) don't count; they borrow their package's NICs.
+ */
+static int buckets_balanced(hwloc_topology_t*  topology,
+                            enum bucket_policy bucket_policy,
+                            int                num_nics,
+                            struct nic_entry*  nics,
+                            const char*        partition)
+{
+    int         nbuckets;
+    int*        counts;
+    int         expected = 0;
+    int         balanced = 1;
+    hwloc_obj_t numa;
+    int         i;
+
+    nbuckets = count_buckets(topology, bucket_policy);
+    if (nbuckets < 2) return (0);
+    counts = calloc(nbuckets, sizeof(*counts));
+    if (!counts) return (0);
+
+    for (i = 0; i < num_nics && balanced; i++) {
+        if (partition && !in_list(partition, nics[i].name)) continue;
+        /* a NIC local to several NUMA nodes (e.g. attached to the package
+         * in sub-NUMA clustering mode) doesn't belong to any one of them
+         */
+        if (bucket_policy == BUCKET_NUMA
+            && hwloc_bitmap_weight(nics[i].locality->nodeset) != 1)
+            balanced = 0;
+        else
+            counts[nic_bucket(topology, bucket_policy, &nics[i])]++;
+    }
+
+    for (i = 0; i < nbuckets && balanced; i++) {
+        if (bucket_policy == BUCKET_NUMA) {
+            numa = hwloc_get_numanode_obj_by_os_index(*topology, i);
+            if (numa && hwloc_bitmap_iszero(numa->cpuset)) continue;
+        }
+        if (!expected) expected = counts[i];
+        if (!counts[i] || counts[i] != expected) balanced = 0;
+    }
+    free(counts);
+
+    return (balanced);
+}
+
+/* Choose the finest bucket policy that gives every bucket an equal share of
+ * the NICs: numa, then package, then all.
+ */
+static enum bucket_policy auto_bucket_policy(hwloc_topology_t* topology,
+                                             int               num_nics,
+                                             struct nic_entry* nics,
+                                             const char*       partition)
+{
+    if (buckets_balanced(topology, BUCKET_NUMA, num_nics, nics, partition))
+        return (BUCKET_NUMA);
+    if (buckets_balanced(topology, BUCKET_PACKAGE, num_nics, nics, partition))
+        return (BUCKET_PACKAGE);
+    return (BUCKET_ALL);
+}
+
+/* Give each CPU-less NUMA node without NICs of its own those of the other
+ * NUMA nodes in its package, for callers that ask about memory there.
+ */
+static void fill_cpuless_buckets(hwloc_topology_t* topology,
+                                 int               nbuckets,
+                                 struct bucket*    buckets)
+{
+    hwloc_obj_t numa;
+    hwloc_obj_t other;
+    hwloc_obj_t package;
+    int         i;
+    int         j;
+    int         k;
+
+    for (i = 0; i < nbuckets; i++) {
+        numa = hwloc_get_numanode_obj_by_os_index(*topology, i);
+        if (buckets[i].num_nics || !numa || !hwloc_bitmap_iszero(numa->cpuset))
+            continue;
+        package = hwloc_get_ancestor_obj_by_type(*topology, HWLOC_OBJ_PACKAGE,
+                                                 numa);
+        for (j = 0; j < nbuckets; j++) {
+            other = hwloc_get_numanode_obj_by_os_index(*topology, j);
+            if (!other || !buckets[j].num_nics
+                || hwloc_bitmap_iszero(other->cpuset)
+                || hwloc_get_ancestor_obj_by_type(
+                       *topology, HWLOC_OBJ_PACKAGE, other)
+                       != package)
+                continue;
+            buckets[i].nics = realloc(
+                buckets[i].nics,
+                (buckets[i].num_nics + buckets[j].num_nics)
+                    * sizeof(*buckets[i].nics));
+            assert(buckets[i].nics);
+            for (k = 0; k < buckets[j].num_nics; k++) {
+                buckets[i].nics[buckets[i].num_nics]
+                    = strdup(buckets[j].nics[k]);
+                assert(buckets[i].nics[buckets[i].num_nics]);
+                buckets[i].num_nics++;
             }
+        }
+    }
+}
+
+/* Look up the NICs reserved for a service class in MOCHI_PLUMBER_PARTITIONS
+ * (e.g. "server:cxi0,cxi2;client:cxi1,cxi3") and return them as a comma
+ * separated list (to be freed by the caller).
+ */
+static int find_partition(const char* service_class, char** partition)
+{
+    const char*          p = getenv("MOCHI_PLUMBER_PARTITIONS");
+    const struct config* config;
+    size_t               len;
 
-            (*buckets)[bucket_idx].num_nics++;
-            (*buckets)[bucket_idx].nics
-                = realloc((*buckets)[bucket_idx].nics,
-                          (*buckets)[bucket_idx].num_nics
-                              * sizeof(*(*buckets)[bucket_idx].nics));
-            assert((*buckets)[bucket_idx].nics);
-            (*buckets)[bucket_idx].nics[(*buckets)[bucket_idx].num_nics - 1]
-                = strdup(cur->domain_attr->name);
-            assert((*buckets)[bucket_idx]
-                       .nics[(*buckets)[bucket_idx].num_nics - 1]);
+    if (!p && (config = get_config())) p = config->partitions;
+
+    while (p && *p) {
+        len = strcspn(p, ":;");
+        if (p[len] == ':' && strlen(service_class) == len
+            && strncmp(p, service_class, len) == 0) {
+            p += len + 1;
+            *partition = strndup(p, strcspn(p, ";"));
+            assert(*partition);
+            return (0);
         }
+        p += strcspn(p, ";");
+        if (*p) p++;
+    }
+
+    fprintf(stderr,
+            "Error: no NIC partition for service class \"%s\" in "
+            "MOCHI_PLUMBER_PARTITIONS.\n",
+            service_class);
+    return (-1);
+}
+
+/* whether a comma separated list contains name */
+static int in_list(const char* list, const char* name)
+{
+    size_t len;
+
+    while (*list) {
+        len = strcspn(list, ",");
+        if (strlen(name) == len && strncmp(list, name, len) == 0) return (1);
+        list += len;
+        if (*list) list++;
     }
-    fi_freeinfo(info);
 
     return (0);
 }
@@ -521,11 +4470,226 @@ static int setup_buckets(hwloc_topology_t* topology,
 static void release_buckets(int nbuckets, struct bucket* buckets)
 {
     int i;
+    int j;
 
     for (i = 0; i < nbuckets; i++) {
+        for (j = 0; j < buckets[i].num_nics; j++) free(buckets[i].nics[j]);
         if (buckets[i].nics) free(buckets[i].nics);
     }
     free(buckets);
 
     return;
 }
+
+static const struct config* get_config(void)
+{
+    pthread_once(&g_config_once, load_config);
+    return (g_config);
+}
+
+/* Read the MOCHI_PLUMBER_CONFIG file, if there is one:
+ *
+ *   # settings for every node
+ *   weights = cxi0=1,cxi1=1
+ *
+ *   # rules, tried in order; the first that matches applies
+ *   [host=nid00[0-3]* nics=4]
+ *   bucket_policy = numa
+ *   nic_policy    = bycore
+ *   exclude       = cxi3
+ *   partitions    = server:cxi0;client:cxi1,cxi2
+ *
+ *   [fingerprint=packages=2,numa=8,*]
+ *   bucket_policy = numa>package
+ */
+static void load_config(void)
+{
+    const char*       path = getenv("MOCHI_PLUMBER_CONFIG");
+    struct config*    config;
+    struct node_facts facts = {.num_nics = -1};
+    FILE*             f;
+    char              line[1024];
+    int               lineno = 0;
+    int               state  = 0;
+
+    if (!path || !*path) return;
+    f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: unable to open MOCHI_PLUMBER_CONFIG %s.\n",
+                path);
+        return;
+    }
+    config = calloc(1, sizeof(*config));
+    assert(config);
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (parse_config_line(line, config, &facts, &state) < 0)
+            fprintf(stderr, "Error: %s:%d: ignoring invalid line.\n", path,
+                    lineno);
+        if (state == 3) break;
+    }
+    fclose(f);
+
+    g_config = config;
+}
+
+/* Parse one line, keeping the settings that apply to this node.  *state is
+ * 0 before the first rule, 1 in a rule that doesn't match, 2 in the rule
+ * that matches, and 3 once that rule has ended.
+ */
+static int parse_config_line(char*              line,
+                             struct config*     config,
+                             struct node_facts* facts,
+                             int*               state)
+{
+    char*  key;
+    char*  value;
+    char** setting;
+    char*  end;
+
+    /* strip comments and surrounding whitespace */
+    line[strcspn(line, "#\n")] = '\0';
+    while (isspace((unsigned char)*line)) line++;
+    end = line + strlen(line);
+    while (end > line && isspace((unsigned char)end[-1])) *--end = '\0';
+    if (!*line) return (0);
+
+    if (*line == '[') {
+        if (end[-1] != ']') return (-1);
+        end[-1] = '\0';
+        if (*state == 2)
+            *state = 3;
+        else
+            *state = rule_matches(line + 1, facts) ? 2 : 1;
+        return (0);
+    }
+
+    value = strchr(line, '=');
+    if (!value) return (-1);
+    key = line;
+    for (end = value; end > key && isspace((unsigned char)end[-1]); end--)
+        ;
+    *end = '\0';
+    for (value++; isspace((unsigned char)*value); value++)
+        ;
+
+    if (strcmp(key, "bucket_policy") == 0)
+        setting = &config->bucket_policy;
+    else if (strcmp(key, "nic_policy") == 0)
+        setting = &config->nic_policy;
+    else if (strcmp(key, "exclude") == 0)
+        setting = &config->exclude;
+    else if (strcmp(key, "weights") == 0)
+        setting = &config->weights;
+    else if (strcmp(key, "partitions") == 0)
+        setting = &config->partitions;
+    else
+        return (-1);
+
+    /* settings of rules that don't apply are only checked */
+    if (*state == 1) return (0);
+    free(*setting);
+    *setting = strdup(value);
+    assert(*setting);
+
+    return (0);
+}
+
+/* Does this node match every one of the space-separated criteria
+ * ("host=<pattern>", "fingerprint=<pattern>", "nics=<count>")?
+ */
+static int rule_matches(char* criteria, struct node_facts* facts)
+{
+    char* saveptr = NULL;
+    char* criterion;
+    char* value;
+
+    for (criterion = strtok_r(criteria, " \t", &saveptr); criterion;
+         criterion = strtok_r(NULL, " \t", &saveptr)) {
+        value = strchr(criterion, '=');
+        if (!value) return (0);
+        *value++ = '\0';
+
+        if (strcmp(criterion, "host") == 0) {
+            if (!facts->hostname[0]
+                && gethostname(facts->hostname, sizeof(facts->hostname) - 1)
+                       < 0)
+                return (0);
+            if (fnmatch(value, facts->hostname, 0) != 0) return (0);
+            continue;
+        }
+
+        /* the rest need the topology and NICs */
+        if (facts->num_nics < 0
+            && node_fingerprint(facts->fingerprint, sizeof(facts->fingerprint),
+                                &facts->num_nics)
+                   < 0)
+            return (0);
+        if (strcmp(criterion, "fingerprint") == 0) {
+            if (fnmatch(value, facts->fingerprint, 0) != 0) return (0);
+        } else if (strcmp(criterion, "nics") == 0) {
+            if (atoi(value) != facts->num_nics) return (0);
+        } else
+            return (0);
+    }
+
+    return (1);
+}
+
+/* Describe the shape of this node, e.g.
+ * "packages=2,numa=8,cores=96,nics=4", for config rules to match on.
+ */
+static int node_fingerprint(char* fingerprint, size_t len, int* num_nics)
+{
+    hwloc_topology_t  topology;
+    struct nic_entry* nics;
+    int               ret;
+
+    hwloc_topology_init(&topology);
+    hwloc_topology_set_io_types_filter(topology,
+                                       HWLOC_TYPE_FILTER_KEEP_IMPORTANT);
+    hwloc_topology_load(topology);
+
+    ret = discover_nics(&topology, num_nics, &nics);
+    if (ret != 0) {
+        hwloc_topology_destroy(topology);
+        return (-1);
+    }
+    release_nics(*num_nics, nics);
+
+    snprintf(fingerprint, len, "packages=%d,numa=%d,cores=%d,nics=%d",
+             count_packages(&topology),
+             hwloc_bitmap_weight(hwloc_topology_get_complete_nodeset(topology)),
+             hwloc_get_nbobjs_by_type(topology, HWLOC_OBJ_CORE), *num_nics);
+    hwloc_topology_destroy(topology);
+
+    return (0);
+}
+
+int mochi_plumber_get_node_fingerprint(char** fingerprint)
+{
+    char buf[128];
+    int  num_nics;
+
+    if (node_fingerprint(buf, sizeof(buf), &num_nics) < 0) return (-1);
+    *fingerprint = strdup(buf);
+    return (*fingerprint ? 0 : -1);
+}
+
+/* leave out the NICs that the config file excludes on this node */
+static void drop_excluded_nics(int* num_nics, struct nic_entry* nics)
+{
+    const struct config* config = get_config();
+    int                  i;
+    int                  j = 0;
+
+    if (!config || !config->exclude) return;
+    for (i = 0; i < *num_nics; i++) {
+        if (in_list(config->exclude, nics[i].name))
+            free(nics[i].name);
+        else
+            nics[j++] = nics[i];
+    }
+    *num_nics = j;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file byblock.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+/* Sample NIC policy plugin: splits the cores into contiguous blocks, one
+ * per NIC in the bucket, rather than interleaving them the way the
+ * built-in "bycore" policy does.  Use it as
+ * "plugin:<pkglibdir>/mochi-plumber-byblock.so".
+ */
+
+#include <hwloc.h>
+
+#include "mochi-plumber-plugin.h"
+
+static int byblock_select(void*                                   state,
+                          const struct mochi_plumber_plugin_args* args,
+                          int*                                    nic_idx)
+{
+    const struct mochi_plumber_bucket* bucket;
+    hwloc_cpuset_t                     domain;
+    int                                first;
+    int                                pos;
+    int                                total;
+
+    first = hwloc_bitmap_first(args->cpuset);
+    if (first < 0) return (-1);
+
+    /* the cores that share the bucket: those of the caller's NUMA
+     * node(s) when there is a bucket per domain, otherwise all of them
+     */
+    domain = hwloc_bitmap_alloc();
+    if (!domain) return (-1);
+    if (args->nbuckets > 1)
+        hwloc_cpuset_from_nodeset(args->topology, domain, args->nodeset);
+    else
+        hwloc_bitmap_copy(domain,
+                          hwloc_topology_get_allowed_cpuset(args->topology));
+
+    total = hwloc_bitmap_weight(domain);
+    hwloc_bitmap_clr_range(domain, first, -1);
+    pos = hwloc_bitmap_weight(domain);
+    hwloc_bitmap_free(domain);
+    if (total <= 0 || pos < 0 || pos >= total) return (-1);
+
+    bucket   = &args->buckets[args->bucket_idx];
+    *nic_idx = (long)pos * bucket->num_nics / total;
+    return (0);
+}
+
+const struct mochi_plumber_plugin mochi_plumber_plugin
+    = {.version  = MOCHI_PLUMBER_PLUGIN_VERSION,
+       .name     = "byblock",
+       .init     = NULL,
+       .finalize = NULL,
+       .select   = byblock_select};
@@ -0,0 +1,113 @@
+/**
+ * @file test-byrank.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+/* Check that the byrank policy spreads the ranks of each bucket evenly over
+ * its NICs, for block and cyclic placement of ranks on buckets.
+ */
+
+#include "../src/mochi-plumber.c"
+
+static int g_rank;
+static int g_size;
+
+static int test_local_rank(int* local_rank, int* local_size, void* arg)
+{
+    (void)arg;
+    *local_rank = g_rank;
+    *local_size = g_size;
+    return (0);
+}
+
+/* Resolve every rank of a node with nbuckets buckets of nics_per_bucket
+ * NICs, each rank in the bucket that the placement puts it in, and check
+ * that every NIC gets the same number of ranks.
+ */
+static int check_placement(const char* param,
+                           int         local_size,
+                           int         nbuckets,
+                           int         nics_per_bucket)
+{
+    struct nic_level level = {0};
+    struct selection sel   = {0};
+    struct bucket*   buckets;
+    int*             users;
+    const char*      nic;
+    int              cyclic = param && strcmp(param, "cyclic") == 0;
+    int              per_bucket;
+    int              failed = 0;
+    int              i;
+    int              j;
+
+    buckets = calloc(nbuckets, sizeof(*buckets));
+    users   = calloc(nbuckets * nics_per_bucket, sizeof(*users));
+    assert(buckets && users);
+    for (i = 0; i < nbuckets; i++) {
+        buckets[i].num_nics = nics_per_bucket;
+        buckets[i].nics     = calloc(nics_per_bucket, sizeof(char*));
+        assert(buckets[i].nics);
+        for (j = 0; j < nics_per_bucket; j++) {
+            buckets[i].nics[j] = malloc(16);
+            assert(buckets[i].nics[j]);
+            snprintf(buckets[i].nics[j], 16, "cxi%d", i * nics_per_bucket + j);
+        }
+    }
+
+    for (i = 0; strcmp(g_nic_policies[i].name, "byrank") != 0; i++)
+        ;
+    level.nic    = &g_nic_policies[i];
+    level.param  = (char*)param;
+    sel.level    = &level;
+    sel.nbuckets = nbuckets;
+    sel.buckets  = buckets;
+    per_bucket   = local_size / nbuckets;
+
+    mochi_plumber_set_local_rank_fn(test_local_rank, NULL);
+    g_size = local_size;
+    for (g_rank = 0; g_rank < local_size; g_rank++) {
+        sel.bucket_idx = cyclic ? g_rank % nbuckets : g_rank / per_bucket;
+        if (select_nic_byrank(&sel, &nic) != 0) {
+            fprintf(stderr, "rank %d: byrank failed\n", g_rank);
+            failed = 1;
+            continue;
+        }
+        users[atoi(nic + strlen("cxi"))]++;
+    }
+    mochi_plumber_set_local_rank_fn(NULL, NULL);
+
+    for (i = 0; i < nbuckets * nics_per_bucket; i++) {
+        if (users[i] != local_size / (nbuckets * nics_per_bucket)) {
+            fprintf(stderr,
+                    "byrank%s%s, %d ranks on %d buckets of %d NICs: cxi%d "
+                    "has %d ranks\n",
+                    param ? ":" : "", param ? param : "", local_size,
+                    nbuckets, nics_per_bucket, i, users[i]);
+            failed = 1;
+        }
+    }
+
+    release_buckets(nbuckets, buckets);
+    free(users);
+
+    return (failed);
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    failed |= check_placement(NULL, 8, 2, 4);
+    failed |= check_placement("block", 8, 2, 4);
+    failed |= check_placement("cyclic", 8, 2, 4);
+    failed |= check_placement("block", 16, 2, 4);
+    failed |= check_placement("cyclic", 16, 2, 4);
+    failed |= check_placement("block", 32, 4, 2);
+    failed |= check_placement("cyclic", 32, 4, 2);
+    failed |= check_placement("cyclic", 6, 1, 3);
+
+    return (failed);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file test-remote-address.c
+ *
+ * (C) The University of Chicago
+ *
+ * See COPYRIGHT in top-level directory.
+ */
+
+/* Check that a client picks the server address on its own rail, whether the
+ * server's addresses name its NICs or are the fabric addresses that a CXI
+ * server publishes.
+ */
+
+#include "../src/mochi-plumber.c"
+
+/* the client's NICs, in the order libfabric lists them; cxiN is the Nth by
+ * PCI address
+ */
+static const char* g_names[] = {"cxi2", "cxi0", "cxi3", "cxi1"};
+
+static void fake_nic_table(void)
+{
+    static struct nic_table       table;
+    static struct nic_entry       nics[4];
+    static struct hwloc_obj       pci_devs[4];
+    static union hwloc_obj_attr_u attrs[4];
+    int                           i;
+
+    for (i = 0; i < 4; i++) {
+        attrs[i].pcidev.bus = atoi(g_names[i] + strlen("cxi")) + 1;
+        pci_devs[i].attr    = &attrs[i];
+        nics[i].name        = (char*)g_names[i];
+        nics[i].pci_dev     = &pci_devs[i];
+    }
+    table.nics     = nics;
+    table.num_nics = 4;
+    g_nic_table    = &table;
+}
+
+static int check(const char*        local,
+                 int                num_remote,
+                 const char* const* remotes,
+                 int                expected)
+{
+    int index = -1;
+    int ret;
+
+    ret = mochi_plumber_select_remote_address(local, num_remote, remotes,
+                                              &index);
+    if (ret != 0 || index != expected) {
+        fprintf(stderr, "%s: got %d (%s), expected %d (%s)\n", local, index,
+                index >= 0 ? remotes[index] : "none", expected,
+                remotes[expected]);
+        return (1);
+    }
+
+    return (0);
+}
+
+int main(void)
+{
+    /* as published by a server listening on each of its NICs, in PCI
+     * order; not in the order of their names
+     */
+    const char* fabric[] = {"ofi+cxi://0x3f1e0:5", "ofi+cxi://0x1a2b0:5",
+                            "ofi+cxi://0x2c0a1:5", "ofi+cxi://0x0ff31:5"};
+    const char* named[]  = {"cxi://cxi1:5", "cxi://cxi0:5"};
+    const char* rails[]  = {"cxi://cxi10:5", "cxi://cxi2:5"};
+    int         failed   = 0;
+
+    fake_nic_table();
+
+    failed |= check("cxi://cxi0", 4, fabric, 0);
+    failed |= check("cxi://cxi1", 4, fabric, 1);
+    failed |= check("ofi+cxi://cxi2:7", 4, fabric, 2);
+    failed |= check("cxi://cxi3", 4, fabric, 3);
+    /* a server with fewer NICs than the client */
+    failed |= check("cxi://cxi3", 2, fabric, 1);
+
+    /* the same NIC name wins; otherwise the same place in name order */
+    failed |= check("cxi://cxi0", 2, named, 1);
+    failed |= check("cxi://cxi1", 2, named, 0);
+    failed |= check("cxi://cxi2", 2, rails, 1);
+    failed |= check("cxi://cxi1", 2, rails, 0);
+    failed |= check("cxi://cxi3", 2, rails, 0);
+
+    return (failed);
+}